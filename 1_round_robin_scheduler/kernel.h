@@ -1,200 +1,700 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 
+#include "policy.h"
+#include "realtime.h"
+#include "timing_wheel.h"
+#include "trace.h"
+#include "transport.h"
 #include "utils.h"
+#include "workload.h"
 
+// One IO device: up to `queueDepth` requests (0 = unlimited) are served at
+// once, the rest wait in FIFO order. Service takes burst / serviceRate ticks.
+struct IoDevice {
+    IoDeviceConfig config;
+    std::map<int, PartialUserProcess*> inService;
+    std::queue<PartialUserProcess*> waiting;
+    unsigned long long requests = 0;
+    unsigned long long queuedTicks = 0;
+    unsigned long long serviceTicks = 0;
+};
+
+// Completions are scheduled on a timing wheel when service starts, so a tick
+// only touches requests that finish in it. The user process hears about its
+// IO once, at completion, with the whole burst, in the kernel's tick batch.
 class IoHandler {
     public: 
-        IoHandler(int msgid): msgid(msgid) {};
-
-        void addProcess(PartialUserProcess* process) {
-            ioQueue.push(process);
-        }
-
-        std::queue<PartialUserProcess*> ioHandlerOnTick() {
-            std::queue<PartialUserProcess*> queueTemp;
-            std::queue<PartialUserProcess*> ioFinishedQueue;
-            while(!ioQueue.empty()) {
-                PartialUserProcess *targetIoProcess = ioQueue.front();
-                ioQueue.pop();
-                targetIoProcess->remainingIoBurst--;
-                sendCommand(msgid, targetIoProcess->pid, ParentCommand::EXECUTE_IO,{TIME_TICK});
-                if(targetIoProcess->remainingIoBurst > 0) {
-                    queueTemp.push(targetIoProcess);
-                } else {
-                    sendCommand(msgid, targetIoProcess->pid, ParentCommand::DESELECT);
-                    if(targetIoProcess->remainingCpuBurst>0) ioFinishedQueue.push(targetIoProcess);
+        IoHandler(CommandBatcher& commands, const std::vector<IoDeviceConfig>& configs): commands(commands) {
+            for(auto& config : configs) devices.push_back(IoDevice{config, {}, {}});
+        };
+
+        void addProcess(PartialUserProcess* process, unsigned now) {
+            if(process->ioDevice < 0 || process->ioDevice >= (int)devices.size()) process->ioDevice = 0;
+            IoDevice& device = devices[process->ioDevice];
+            device.requests++;
+            pending++;
+            if(device.config.queueDepth == 0 || device.inService.size() < device.config.queueDepth) {
+                startService(device, process, now);
+            } else {
+                device.waiting.push(process);
+            }
+        }
+
+        std::vector<PartialUserProcess*> ioHandlerOnTick(unsigned now) {
+            std::vector<PartialUserProcess*> ioFinishedProcesses;
+            std::vector<PartialUserProcess*> due;
+            // A freed slot may start a request that completes in this tick too.
+            for(completions.advance(now, due); !due.empty(); completions.advance(now, due)) {
+                std::vector<PartialUserProcess*> finished;
+                finished.swap(due);
+                for(PartialUserProcess* targetIoProcess : finished) {
+                    IoDevice& device = devices[targetIoProcess->ioDevice];
+                    device.inService.erase(targetIoProcess->pid);
+                    pending--;
+                    commands.add(targetIoProcess->pid, ParentCommand::EXECUTE_IO, {targetIoProcess->remainingIoBurst});
+                    commands.add(targetIoProcess->pid, ParentCommand::DESELECT);
+                    targetIoProcess->remainingIoBurst = 0;
+                    if(targetIoProcess->remainingCpuBurst>0) ioFinishedProcesses.push_back(targetIoProcess);
+                    if(!device.waiting.empty()) {
+                        PartialUserProcess* next = device.waiting.front();
+                        device.waiting.pop();
+                        startService(device, next, now);
+                    }
                 }
             }
-            ioQueue = queueTemp;
-            return ioFinishedQueue;
+            return ioFinishedProcesses;
+        }
+
+        // Ticks that can pass before the next IO completion, -1 if nobody waits.
+        int ticksUntilNextCompletion(unsigned now) {
+            std::optional<unsigned long long> deadline = completions.nextDeadline();
+            if(!deadline) return -1;
+            return *deadline > now ? *deadline - now : 0;
         }
 
         void logInfo() {
-            std::cout << "[IO Queue Info]";
-            if(!ioQueue.empty()) {
-                printTableHeader();
-                printQueue(ioQueue);
-                printTableFooter();
-            } else {
-                std::cout << " : Empty" << std::endl;
+            if(!logEnabled(LogSubsystem::IO, LogLevel::DEBUG)) return;
+            std::ostream& out = logStream();
+            for(auto& device : devices) {
+                out << "[IO Queue Info] " << device.config.name;
+                if(!device.inService.empty() || !device.waiting.empty()) {
+                    printTableHeader(out);
+                    for(auto& [pid, process] : device.inService) printProcess(process, out);
+                    printQueue(device.waiting, out);
+                    printTableFooter(out);
+                } else {
+                    out << " : Empty" << std::endl;
+                }
+            }
+        }
+
+        void stat(unsigned totalTime) const {
+            for(auto& device : devices) {
+                std::string label = "IO " + device.config.name;
+                printf("\t%-20s | %-10llu\n", (label + " Requests").c_str(), device.requests);
+                printf("\t%-20s | %-10.2f\n", (label + " Queue Wait").c_str(), device.requests ? (double)device.queuedTicks / device.requests : 0.0);
+                printf("\t%-20s | %-10.2f\n", (label + " Avg Busy").c_str(), totalTime ? (double)device.serviceTicks / totalTime : 0.0);
             }
         }
 
         bool isEmpty() {
-            return ioQueue.empty();
+            return pending == 0;
         }
 
     private :
-        int msgid;
-        std::queue<PartialUserProcess*> ioQueue;
+        CommandBatcher& commands;
+        size_t pending=0;
+        std::vector<IoDevice> devices;
+        TimingWheel<PartialUserProcess*> completions;
+
+        void startService(IoDevice& device, PartialUserProcess* process, unsigned now) {
+            unsigned duration = std::max(1.0, std::ceil(process->remainingIoBurst / device.config.serviceRate));
+            device.queuedTicks += now - process->blockedSince;
+            device.serviceTicks += duration;
+            device.inService[process->pid] = process;
+            completions.schedule(now + duration - 1, process);
+        }
+};
+
+// Response is the delay from arrival to the first dispatch, waiting the time
+// spent in ready queues and turnaround the time from arrival to completion.
+struct SimulationResult {
+    LatencySummary response;
+    LatencySummary waiting;
+    LatencySummary turnaround;
+    unsigned totalTime;
+    // Ticks all CPUs spent switching between processes.
+    unsigned switchTicks;
+};
+
+// One simulated processor with its own run queue and time slice accounting.
+struct Cpu {
+    int id;
+    std::unique_ptr<SchedulingPolicy> runQueue;
+    PartialUserProcess* currentProcess = NULL;
+    unsigned timePassed = 0;
+    unsigned timeSlice = 0;
+    int ioRequestHint = -1;
+    unsigned busyTicks = 0;
+    unsigned migrations = 0;
+    // The process dispatched last and the ticks still needed to switch to it;
+    // it only starts running once they are over.
+    int lastPid = -1;
+    unsigned switchTicksLeft = 0;
+    unsigned switchTicks = 0;
 };
 
 class KernelProcess {
 public:
-    KernelProcess(int timeQuantum, std::vector<PartialUserProcess*> childProcesses, int msgid) : timeQuantum(timeQuantum), msgid(msgid), childProcesses(childProcesses), ioHandler(IoHandler(msgid)) {
-        for(auto& child : childProcesses) {
-            readyQueue.push(child);
+    KernelProcess(unsigned timeQuantum, std::vector<PartialUserProcess*> initialProcesses, Transport& transport, pid_t kernelPid, SimulationOptions options = {}) : timeQuantum(timeQuantum), transport(transport), kernelPid(kernelPid), outbox(transport, kernelPid), ioHandler(outbox, options.ioDevices), realTime(options.realTimeTasks, options.numCpus, options.realTimeAdmission), options(options) {
+        for(int i = 0; i < options.numCpus; i++) {
+            cpus.push_back(Cpu{i, makeSchedulingPolicy(options.policy, timeQuantum)});
+        }
+        if(!options.tracePath.empty()) {
+            TraceHeader header = {{'S', 'C', 'H', 'T'}, TRACE_VERSION, (uint16_t)cpus.size(), timeQuantum, (uint32_t)initialProcesses.size(), {}};
+            // Not NUL-terminated when the name fills the field.
+            const char* policy = cpus.front().runQueue->name();
+            memcpy(header.policy, policy, std::min(strlen(policy), sizeof(header.policy)));
+            trace.open(options.tracePath, header);
+        }
+        for(auto& child : initialProcesses) {
+            admitProcess(child);
         }
      }
 
+    // Further processes arrive from a workload file while the simulation
+    // runs; `spawn` creates the user process for an entry (NULL on failure).
+    void setWorkload(WorkloadReader* reader, std::function<PartialUserProcess*(const WorkloadEntry&)> spawn) {
+        workload = reader;
+        spawnProcess = spawn;
+    }
+
+    // Per-tick tables; a trace records the same information far cheaper.
     void logInfo() {
-        std::cout << std::endl;
-        std::cout << "-+-" << std::endl;
-        std::cout << " | ime Tick T :" << totalTimePassed << std::endl;
-        std::cout << " |" << std::endl;
-        if(currentCpuProcess) std::cout << "[PID of Process in Running State] " << currentCpuProcess->pid << std::endl;
-        
-        std::cout << "[Running Processes Info]";
-        if(currentCpuProcess) {
-            printTableHeader();
-            printProcess(currentCpuProcess);
-            printTableFooter();
-        } else {
-            std::cout << " : None" << std::endl;
-        }
-                
-        std::cout << "[Ready Queue Info]";
-        if(!readyQueue.empty()) {
-            printTableHeader();
-            printQueue(readyQueue);
-            printTableFooter();
-        } else {
-            std::cout << " : Empty" << std::endl;
+        if(trace.isOpen()) return;
+        if(logEnabled(LogSubsystem::SCHED, LogLevel::DEBUG)) {
+            std::ostream& out = logStream();
+            out << std::endl;
+            out << "-+-" << std::endl;
+            out << " | ime Tick T :" << totalTimePassed << std::endl;
+            out << " |" << std::endl;
+            for(auto& cpu : cpus) {
+                if(cpu.currentProcess) out << "[PID of Process in Running State] " << cpu.currentProcess->pid << cpuLabel(cpu) << std::endl;
+                if(realTime.hasReady(cpu.id)) {
+                    const RealTimeJob& job = realTime.current(cpu.id);
+                    out << "[Real-Time Job] task " << realTime.taskIndex(job) << ", deadline " << job.deadline << ", remaining " << job.remaining << cpuLabel(cpu) << std::endl;
+                }
+            }
+
+            out << "[Running Processes Info]";
+            if(anyRunning()) {
+                printTableHeader(out);
+                for(auto& cpu : cpus) {
+                    if(cpu.currentProcess) printProcess(cpu.currentProcess, out);
+                }
+                printTableFooter(out);
+            } else {
+                out << " : None" << std::endl;
+            }
+
+            for(auto& cpu : cpus) {
+                out << "[Ready Queue Info]" << cpuLabel(cpu);
+                if(!cpu.runQueue->empty()) {
+                    printTableHeader(out);
+                    printProcesses(cpu.runQueue->snapshot(), out);
+                    printTableFooter(out);
+                } else {
+                    out << " : Empty" << std::endl;
+                }
+            }
         }
 
         ioHandler.logInfo();
     }
 
     void tickHandler() {
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        std::cout << "--Parent Process INIT--" << std::endl;
+        if(!options.fastForward) std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        LOG(SCHED, INFO) << "--Parent Process INIT--" << std::endl;
         logInfo();
 
-        while(!readyQueue.empty() || !ioHandler.isEmpty() || currentCpuProcess) {
+        while(hasWork()) {
+            arrivalHandlerOnTick();
+            realTime.releaseOnTick(totalTimePassed);
             msgHandlerOnTick();
-            cpuHandlerOnTick();
+            for(auto& cpu : cpus) {
+                cpuHandlerOnTick(cpu);
+            }
             ioHandlerOnTick();
+            flushCommands();
 
             totalTimePassed++;
-            currentCpuTimePassed++;
+            for(auto& cpu : cpus) {
+                cpu.timePassed++;
+            }
+
+            if(options.fastForward) {
+                waitForAcks();
+                fastForwardPlainTicks();
+            }
 
             logInfo();
-            std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK*80));
+            // A paced run shows its log tick by tick; the tick sleeps anyway.
+            if(!options.fastForward) {
+                logFlush();
+                std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK*80));
+            }
         }
-        std::cout << "All Task Finished!" << std::endl;
+        LOG(SCHED, INFO) << "All Task Finished!" << std::endl;
     }
 
     void run() {
+        // Whatever was logged before the tick thread starts comes first.
+        logFlush();
         thread = std::thread(&KernelProcess::tickHandler, this);
         thread.join();
     }
 
     void stat() {
+        logSync();
         std::cout << "--------------------STAT--------------------" << std::endl;
-        printf("\t%-20s | %-10d\n", "Average Response Time", totalResponseTime / NUM_CHILD_PROCESSES);
+        printf("\t%-20s | %-10s\n", "Scheduling Policy", cpus.front().runQueue->name());
+        printf("\t%-20s | %-10llu\n", "Random Seed", (unsigned long long)masterSeed());
+        SimulationResult summary = result();
         printf("\t%-20s | %-10d\n", "Total Execution Time ", totalTimePassed);
+        printf("\t%-20s | %-10.2f\n", "Throughput/100 Ticks", totalTimePassed ? childProcesses.size() * 100.0 / totalTimePassed : 0.0);
+        for(auto& cpu : cpus) {
+            std::string label = "CPU " + std::to_string(cpu.id);
+            printf("\t%-20s | %-10.2f\n", (label + " Utilization %").c_str(), totalTimePassed ? cpu.busyTicks * 100.0 / totalTimePassed : 0.0);
+            printf("\t%-20s | %-10u\n", (label + " Migrations").c_str(), cpu.migrations);
+            printf("\t%-20s | %-10u\n", (label + " Switch Ticks").c_str(), cpu.switchTicks);
+            if(realTime.enabled()) printf("\t%-20s | %-10.2f\n", (label + " RT Util %").c_str(), totalTimePassed ? realTime.busyTicks(cpu.id) * 100.0 / totalTimePassed : 0.0);
+        }
+        printf("\t%-20s | %-10.2f\n", "Switch Overhead %", totalTimePassed ? summary.switchTicks * 100.0 / ((double)totalTimePassed * cpus.size()) : 0.0);
+        if(realTime.enabled()) realTime.stat(totalTimePassed);
+        ioHandler.stat(totalTimePassed);
+        printf("\t%-20s | %-10llu\n", "Messages Handled", messagesHandled);
+        printf("\t%-20s | %-10.2f\n", "Inbox Depth Avg", totalTimePassed ? (double)inboxDepthSum / totalTimePassed : 0.0);
+        printf("\t%-20s | %-10zu\n", "Inbox Depth Max", inboxDepthMax);
+        printf("\n\t%-10s | %-9s | %-9s | %-9s | %-9s | %-9s\n", "Latency", "Average", "p50", "p95", "p99", "Max");
+        printLatency("Response", summary.response);
+        printLatency("Waiting", summary.waiting);
+        printLatency("Turnaround", summary.turnaround);
+        printLatency("Msg Age", summarizeLatencies(messageAges));
+        if(realTime.enabled()) printLatency("Lateness", realTime.latenessSummary());
+        printf("\n\t%-8s | %-8s | %-9s | %-10s | %-8s | %-8s | %-8s\n", "PID", "Arrival", "First Run", "Completion", "Wait", "IO Wait", "Switches");
+        for(auto& child : childProcesses) {
+            printf("\t%-8d | %-8d | %-9d | %-10d | %-8u | %-8u | %-8u\n", child->pid, child->arrivalTick, child->firstRunTick, child->completionTick, child->waitingTicks, child->ioWaitTicks, child->contextSwitches);
+        }
         std::cout << "--------------------------------------------" << std::endl;
     }
 
+    SimulationResult result() const {
+        std::vector<int> response, waiting, turnaround;
+        for(auto& child : childProcesses) {
+            response.push_back(child->firstRunTick - child->arrivalTick);
+            waiting.push_back(child->waitingTicks);
+            turnaround.push_back(child->completionTick - child->arrivalTick);
+        }
+        unsigned switchTicks = 0;
+        for(auto& cpu : cpus) switchTicks += cpu.switchTicks;
+        return {summarizeLatencies(response), summarizeLatencies(waiting), summarizeLatencies(turnaround), totalTimePassed, switchTicks};
+    }
+
     void exit () {
-        for (auto& child : childProcesses) {
-            waitpid(child->pid, nullptr, 0);
+        trace.close();
+        if(!options.inProcess) {
+            for (auto& child : childProcesses) {
+                waitpid(child->pid, nullptr, 0);
+            }
         }
         stat();
     }
 
 private:
     unsigned totalTimePassed=0;
-    unsigned totalResponseTime=0;
-    unsigned currentCpuTimePassed=0;
 
-    PartialUserProcess* currentCpuProcess=NULL;
-    std::queue<PartialUserProcess*> readyQueue;
+    std::vector<Cpu> cpus;
     std::vector<PartialUserProcess*> childProcesses;
-    int timeQuantum;
-    int msgid;
+    unsigned timeQuantum;
+    Transport& transport;
+    pid_t kernelPid;
     std::thread thread;
+    // Commands of the current tick, sent to the children when it ends.
+    CommandBatcher outbox;
     IoHandler ioHandler;
+    RealTimeClass realTime;
+    SimulationOptions options;
+    TraceWriter trace;
+
+    unsigned pendingAcks=0;
+    // Messages from children in arrival order, stamped with the first tick
+    // they could have been handled in.
+    struct InboxMessage {
+        CommandMessage command;
+        unsigned receivedTick;
+    };
+    std::queue<InboxMessage> inbox;
+    unsigned long long messagesHandled=0;
+    unsigned long long inboxDepthSum=0;
+    size_t inboxDepthMax=0;
+    std::vector<int> messageAges;
+
+    WorkloadReader* workload = NULL;
+    std::function<PartialUserProcess*(const WorkloadEntry&)> spawnProcess;
+
+    // The process becomes ready on the least loaded CPU it may run on.
+    // Affinities and nice values refer to the order in which processes arrive.
+    void admitProcess(PartialUserProcess* process) {
+        int index = childProcesses.size();
+        for(auto& [affinityIndex, mask] : options.affinities) {
+            if(affinityIndex != index) continue;
+            if((mask & allCpusMask()) == 0) {
+                std::cerr << ERROR_LOG_PREFIX << "Invalid affinity for process " << index << ", ignored." << std::endl;
+                continue;
+            }
+            process->affinity = mask & allCpusMask();
+        }
+        for(auto& [niceIndex, nice] : options.nices) {
+            if(niceIndex == index) process->nice = nice;
+        }
+        process->arrivalTick = totalTimePassed;
+        process->readySince = totalTimePassed;
+        process->offCpuSince = totalTimePassed;
+        childProcesses.push_back(process);
+        Cpu* cpu = placeProcess(process);
+        trace.record(TraceEventType::ARRIVE, totalTimePassed, process, cpu->id);
+        cpu->runQueue->enqueue(process);
+    }
+
+    void arrivalHandlerOnTick() {
+        WorkloadEntry entry;
+        while(workload && workload->nextArrival() && *workload->nextArrival() <= totalTimePassed && workload->next(entry)) {
+            PartialUserProcess* process = spawnProcess(entry);
+            if(process) admitProcess(process);
+        }
+    }
+
+    unsigned long long allCpusMask() const {
+        return cpus.size() >= 64 ? ~0ULL : (1ULL << cpus.size()) - 1;
+    }
+
+    std::string cpuLabel(const Cpu& cpu) const {
+        return cpus.size() > 1 ? " CPU " + std::to_string(cpu.id) : "";
+    }
+
+    // Real-time tasks run only while best-effort work is left.
+    bool hasWork() {
+        return readyCount() > 0 || !ioHandler.isEmpty() || anyRunning() || (workload && workload->nextArrival());
+    }
+
+    bool anyRunning() const {
+        for(auto& cpu : cpus) {
+            if(cpu.currentProcess) return true;
+        }
+        return false;
+    }
+
+    size_t readyCount() const {
+        size_t count = 0;
+        for(auto& cpu : cpus) count += cpu.runQueue->size();
+        return count;
+    }
+
+    Cpu* cpuRunning(pid_t pid) {
+        for(auto& cpu : cpus) {
+            if(cpu.currentProcess && cpu.currentProcess->pid == pid) return &cpu;
+        }
+        return NULL;
+    }
+
+    // A process returning from IO goes back to the CPU it last ran on, if it
+    // may; otherwise it joins the least loaded CPU of its affinity mask.
+    Cpu* placeProcess(PartialUserProcess* process) {
+        if(process->lastCpu >= 0 && allowedOn(process, process->lastCpu)) {
+            return &cpus[process->lastCpu];
+        }
+        Cpu* target = NULL;
+        for(auto& cpu : cpus) {
+            if(!allowedOn(process, cpu.id)) continue;
+            size_t load = cpu.runQueue->size() + (cpu.currentProcess ? 1 : 0);
+            if(!target || load < target->runQueue->size() + (target->currentProcess ? 1 : 0)) target = &cpu;
+        }
+        return target ? target : &cpus.front();
+    }
+
+    // An idle CPU takes work from the CPU with the longest run queue that has
+    // a process allowed to run here.
+    PartialUserProcess* stealFor(Cpu& thief) {
+        std::vector<Cpu*> victims;
+        for(auto& cpu : cpus) {
+            if(cpu.id != thief.id && !cpu.runQueue->empty()) victims.push_back(&cpu);
+        }
+        std::stable_sort(victims.begin(), victims.end(), [](Cpu* a, Cpu* b) { return a->runQueue->size() > b->runQueue->size(); });
+        for(Cpu* victim : victims) {
+            PartialUserProcess* process = victim->runQueue->steal(thief.id);
+            if(process) return process;
+        }
+        return NULL;
+    }
+
+    void printLatency(const char* name, const LatencySummary& latency) const {
+        printf("\t%-10s | %-9.2f | %-9d | %-9d | %-9d | %-9d\n", name, latency.average, latency.p50, latency.p95, latency.p99, latency.max);
+    }
+
+    void sendToChild(pid_t pid, int command, std::initializer_list<int> additionalParams = {}) {
+        outbox.add(pid, command, additionalParams);
+    }
+
+    // One message per child addressed since the last flush, each answered
+    // with one acknowledgement in fast-forward mode.
+    void flushCommands() {
+        unsigned sent = outbox.flush();
+        if(options.fastForward) pendingAcks += sent;
+    }
+
+    // Blocks until every child addressed this tick has handled its commands.
+    // Anything else the children sent meanwhile is kept for the next ticks.
+    void waitForAcks() {
+        flushCommands();
+        while(pendingAcks > 0) {
+            CommandMessage newMessage;
+            if(!receiveCommand(transport, kernelPid, newMessage, true)) {
+                std::cerr << ERROR_LOG_PREFIX << pendingAcks << " acknowledgements lost, continue." << std::endl;
+                pendingAcks = 0;
+                break;
+            }
+            if(newMessage.command != ChildCommand::ACK) {
+                inbox.push({newMessage, totalTimePassed});
+                continue;
+            }
+            pendingAcks--;
+            Cpu* cpu = cpuRunning(newMessage.sender);
+            if(newMessage.paramCount >= 1 && cpu) {
+                cpu->ioRequestHint = newMessage.params[0];
+            }
+        }
+    }
+
+    // Number of upcoming ticks in which no process is dispatched, preempted,
+    // finished or returned from IO and no message is waiting.
+    int plainTicksAhead() {
+        if(!inbox.empty() || !hasWork()) return 0;
+
+        int ticks = ioHandler.ticksUntilNextCompletion(totalTimePassed);
+        int untilRelease = realTime.ticksUntilRelease(totalTimePassed);
+        if(untilRelease >= 0) ticks = (ticks == -1) ? untilRelease : std::min(ticks, untilRelease);
+        size_t ready = readyCount();
+        for(auto& cpu : cpus) {
+            PartialUserProcess* current = cpu.currentProcess;
+            if(realTime.runnable(cpu.id, totalTimePassed)) {
+                if(current) return 0; // the job preempts it next tick
+                int jobTicks = realTime.plainTicks(cpu.id, totalTimePassed);
+                ticks = (ticks == -1) ? jobTicks : std::min(ticks, jobTicks);
+                continue;
+            }
+            int untilUnthrottled = realTime.ticksUntilUnthrottled(cpu.id, totalTimePassed);
+            if(untilUnthrottled >= 0) ticks = (ticks == -1) ? untilUnthrottled : std::min(ticks, untilUnthrottled);
+            if(!current) {
+                if(ready > 0) return 0; // it may dispatch or steal next tick
+                continue;
+            }
+            if(cpu.switchTicksLeft > 0) {
+                ticks = (ticks == -1) ? cpu.switchTicksLeft : std::min(ticks, (int)cpu.switchTicksLeft);
+                continue;
+            }
+            if(cpu.runQueue->shouldPreempt(current)) return 0;
+            int untilPreempt = cpu.runQueue->ticksUntilPreemptCheck(current);
+            int cpuTicks = current->remainingCpuBurst;
+            if(cpu.timeSlice) cpuTicks = std::min(cpuTicks, std::max((int)cpu.timeSlice - (int)cpu.timePassed, 0));
+            if(cpu.ioRequestHint > 0) cpuTicks = std::min(cpuTicks, cpu.ioRequestHint);
+            if(untilPreempt >= 0) cpuTicks = std::min(cpuTicks, untilPreempt);
+            ticks = (ticks == -1) ? cpuTicks : std::min(ticks, cpuTicks);
+        }
+        if(workload && workload->nextArrival()) {
+            int ticksUntilArrival = std::max((int)*workload->nextArrival() - (int)totalTimePassed, 0);
+            ticks = (ticks == -1) ? ticksUntilArrival : std::min(ticks, ticksUntilArrival);
+        }
+        return std::max(ticks, 0);
+    }
+
+    // Applies every plain tick ahead at once, exactly as the tick loop would.
+    void fastForwardPlainTicks() {
+        int ticks = plainTicksAhead();
+        if(ticks == 0) return;
+
+        for(auto& cpu : cpus) {
+            PartialUserProcess* current = cpu.currentProcess;
+            if(realTime.runnable(cpu.id, totalTimePassed)) {
+                realTime.fastForward(cpu.id, totalTimePassed, ticks);
+                cpu.timePassed += ticks;
+                continue;
+            }
+            if(current && cpu.switchTicksLeft > 0) {
+                // The jump ends with the switch at the latest.
+                cpu.switchTicksLeft -= ticks;
+                cpu.switchTicks += ticks;
+                cpu.timePassed = 1;
+                continue;
+            }
+            if(current) {
+                current->remainingCpuBurst -= ticks;
+                sendToChild(current->pid, ParentCommand::EXECUTE_CPU, {ticks * TIME_TICK});
+                cpu.runQueue->onRun(current, ticks);
+                cpu.busyTicks += ticks;
+            }
+            cpu.timePassed += ticks;
+        }
+        // Completions happen in the last jumped tick.
+        for(PartialUserProcess* process : ioHandler.ioHandlerOnTick(totalTimePassed + ticks - 1)) {
+            returnFromIo(process, totalTimePassed + ticks - 1);
+        }
+
+        totalTimePassed += ticks;
+        waitForAcks();
+    }
     
-    void commandHandler(int command, std::vector<int> additionalParams={}) {
-        switch(command) {
+    void commandHandler(const CommandMessage& command) {
+        switch(command.command) {
             case ChildCommand::EARLY_CPU_FINISH:
             case ChildCommand::EARLY_IO_FINISH:
                 break;
             case ChildCommand::IO_REQUEST:
-                if(additionalParams.empty()) break;
-                int ioBurst = additionalParams.front();
-                std::cout << "IO Burst(" << ioBurst << ") Requested by  : " << currentCpuProcess->pid << std::endl;
-                currentCpuProcess->remainingIoBurst = ioBurst;
-                ioHandler.addProcess(currentCpuProcess);
-                currentCpuProcess = NULL;
+                if(command.paramCount < 1) break;
+                Cpu* cpu = cpuRunning(command.sender);
+                if(!cpu) {
+                    std::cerr << ERROR_LOG_PREFIX << "IO request from " << command.sender << " which is not running, ignored." << std::endl;
+                    break;
+                }
+                int ioBurst = command.params[0];
+                LOG(IO, INFO) << "IO Burst(" << ioBurst << ") Requested by  : " << cpu->currentProcess->pid << std::endl;
+                cpu->currentProcess->remainingIoBurst = ioBurst;
+                cpu->currentProcess->ioDevice = command.paramCount >= 2 ? command.params[1] : 0;
+                cpu->currentProcess->blockedSince = totalTimePassed;
+                cpu->currentProcess->offCpuSince = totalTimePassed;
+                trace.record(TraceEventType::IO_START, totalTimePassed, cpu->currentProcess, cpu->id);
+                ioHandler.addProcess(cpu->currentProcess, totalTimePassed);
+                cpu->currentProcess = NULL;
                 break;
         }
     }
     
-    void cpuHandlerOnTick() {
-        if(currentCpuProcess && currentCpuProcess->remainingCpuBurst<=0) {
-            sendCommand(msgid, currentCpuProcess->pid, ParentCommand::DESELECT);
-            currentCpuProcess = NULL;
+    void cpuHandlerOnTick(Cpu& cpu) {
+        if(cpu.currentProcess && cpu.currentProcess->remainingCpuBurst<=0) {
+            cpu.currentProcess->completionTick = totalTimePassed;
+            trace.record(TraceEventType::EXIT, totalTimePassed, cpu.currentProcess, cpu.id);
+            sendToChild(cpu.currentProcess->pid, ParentCommand::DESELECT);
+            cpu.currentProcess = NULL;
         }
-        if(currentCpuProcess && currentCpuTimePassed % timeQuantum == 0) {
-            std::cout << "current cpu time " << currentCpuTimePassed << " passed. switch from pid: " << currentCpuProcess->pid << std::endl;
-            sendCommand(msgid, currentCpuProcess->pid, ParentCommand::DESELECT);
-            if(currentCpuProcess->remainingCpuBurst > 0) {
-                readyQueue.push(currentCpuProcess);
+        // A real-time job takes the CPU even from a process still switching
+        // in, which goes back to the ready set without losing its level.
+        if(realTime.runnable(cpu.id, totalTimePassed)) {
+            if(cpu.currentProcess) {
+                LOG(SCHED, INFO) << "real-time task " << realTime.taskIndex(realTime.current(cpu.id)) << " preempts pid: " << cpu.currentProcess->pid << cpuLabel(cpu) << std::endl;
+                deselect(cpu, false);
             }
-            currentCpuProcess = NULL;
-            currentCpuTimePassed = 0;
+            cpu.switchTicksLeft = 0;
+            cpu.lastPid = -1;
+            realTime.runTick(cpu.id, totalTimePassed);
+            if(realTime.runnable(cpu.id, totalTimePassed)) return;
+        }
+        // The time slice starts once the switch is over.
+        if(cpu.switchTicksLeft > 0) {
+            cpu.switchTicksLeft--;
+            cpu.switchTicks++;
+            cpu.timePassed = 0;
+            return;
+        }
+        if(cpu.currentProcess && ((cpu.timeSlice && cpu.timePassed >= cpu.timeSlice) || cpu.runQueue->shouldPreempt(cpu.currentProcess))) {
+            LOG(SCHED, INFO) << "current cpu time " << cpu.timePassed << " passed. switch from pid: " << cpu.currentProcess->pid << cpuLabel(cpu) << std::endl;
+            deselect(cpu, true);
+        }
+        if(cpu.currentProcess) {
+            cpu.currentProcess->remainingCpuBurst--;
+            sendToChild(cpu.currentProcess->pid, ParentCommand::EXECUTE_CPU, {TIME_TICK});
+            cpu.runQueue->onRun(cpu.currentProcess, 1);
+            cpu.busyTicks++;
         }
-        if(currentCpuProcess) {
-            currentCpuProcess->remainingCpuBurst--;
-            sendCommand(msgid, currentCpuProcess->pid, ParentCommand::EXECUTE_CPU, {TIME_TICK});
-            totalResponseTime += readyQueue.size(); // readyQueue.size() == number of processes waiting for CPU
+        if(cpu.currentProcess == NULL) {
+            PartialUserProcess* next = !cpu.runQueue->empty() ? cpu.runQueue->pickNext() : stealFor(cpu);
+            if(next) dispatch(cpu, next);
         }
-        if(!readyQueue.empty() && currentCpuProcess == NULL) {
-            currentCpuProcess = readyQueue.front(); 
-            readyQueue.pop();
-            std::cout << "Switch Current CPU Process PID : " << currentCpuProcess->pid << std::endl;
-            sendCommand(msgid, currentCpuProcess->pid, ParentCommand::SELECT_CPU);
-            currentCpuTimePassed = 0;
+    }
+
+    // Takes the running process off `cpu`; an unfinished one is ready again,
+    // through onPreempt if it used up its slice.
+    void deselect(Cpu& cpu, bool sliceOver) {
+        sendToChild(cpu.currentProcess->pid, ParentCommand::DESELECT);
+        cpu.currentProcess->offCpuSince = totalTimePassed;
+        if(cpu.currentProcess->remainingCpuBurst > 0) {
+            cpu.currentProcess->readySince = totalTimePassed;
+            trace.record(TraceEventType::PREEMPT, totalTimePassed, cpu.currentProcess, cpu.id);
+            if(sliceOver) {
+                cpu.runQueue->onPreempt(cpu.currentProcess);
+            } else {
+                cpu.runQueue->enqueue(cpu.currentProcess);
+            }
         }
+        cpu.currentProcess = NULL;
+        cpu.timePassed = 0;
+    }
+
+    void dispatch(Cpu& cpu, PartialUserProcess* process) {
+        if(process->lastCpu >= 0 && process->lastCpu != cpu.id) cpu.migrations++;
+        process->lastCpu = cpu.id;
+        if(process->firstRunTick < 0) process->firstRunTick = totalTimePassed;
+        process->waitingTicks += totalTimePassed - process->readySince;
+        process->contextSwitches++;
+        cpu.switchTicksLeft = switchCost(cpu, process);
+        cpu.lastPid = process->pid;
+        trace.record(TraceEventType::DISPATCH, totalTimePassed, process, cpu.id, cpu.switchTicksLeft);
+        cpu.currentProcess = process;
+        LOG(SCHED, INFO) << "Switch Current CPU Process PID : " << process->pid << cpuLabel(cpu) << (cpu.switchTicksLeft ? " (switch takes " + std::to_string(cpu.switchTicksLeft) + " ticks)" : "") << std::endl;
+        sendToChild(process->pid, ParentCommand::SELECT_CPU);
+        cpu.timePassed = 0;
+        cpu.timeSlice = cpu.runQueue->timeSlice(process);
+        cpu.ioRequestHint = -1;
+    }
+
+    // Nothing if the process was the last one on this CPU, otherwise the
+    // fixed cost plus the warm-up for the ticks it spent off the CPU.
+    unsigned switchCost(const Cpu& cpu, const PartialUserProcess* process) const {
+        const SwitchCost& cost = options.switchCost;
+        if(cpu.lastPid == process->pid) return 0;
+        unsigned long long warmup = (unsigned long long)(totalTimePassed - process->offCpuSince) * cost.warmupPercent / 100;
+        return cost.fixed + std::min<unsigned long long>(warmup, cost.maxWarmup);
     }
 
     void ioHandlerOnTick() {
-        std::queue<PartialUserProcess*> ioFinishedProcesses = ioHandler.ioHandlerOnTick();
-        while(!ioFinishedProcesses.empty()) {
-            readyQueue.push(ioFinishedProcesses.front());
-            ioFinishedProcesses.pop();
+        for(PartialUserProcess* process : ioHandler.ioHandlerOnTick(totalTimePassed)) {
+            returnFromIo(process, totalTimePassed);
         }
     }
 
+    void returnFromIo(PartialUserProcess* process, unsigned now) {
+        process->ioWaitTicks += now - process->blockedSince;
+        process->readySince = now;
+        Cpu* cpu = placeProcess(process);
+        trace.record(TraceEventType::IO_END, now, process, cpu->id);
+        cpu->runQueue->onIoReturn(process);
+    }
+
+    // Moves everything the children sent into the inbox, then handles it in
+    // arrival order up to the per-tick budget; the rest waits a tick.
     void msgHandlerOnTick() {
-        std::vector<int> newMessage = receiveCommand(msgid, getpid());
-        if(!newMessage.empty()) { 
-            std::cout << "Parent received command " << newMessage.front() << std::endl;
-            std::vector<int> additionalParams(newMessage.begin() + 1, newMessage.end());
-            commandHandler(newMessage.front(), additionalParams); 
+        CommandMessage newMessage;
+        while(receiveCommand(transport, kernelPid, newMessage)) {
+            inbox.push({newMessage, totalTimePassed});
+        }
+        inboxDepthSum += inbox.size();
+        inboxDepthMax = std::max(inboxDepthMax, inbox.size());
+        for(unsigned handled = 0; !inbox.empty() && (options.messageBudget == 0 || handled < options.messageBudget); handled++) {
+            InboxMessage next = inbox.front();
+            inbox.pop();
+            messagesHandled++;
+            messageAges.push_back(totalTimePassed - next.receivedTick);
+            LOG(SCHED, DEBUG) << "Parent received command " << (int)next.command.command << std::endl;
+            commandHandler(next.command);
         }
     }
 };
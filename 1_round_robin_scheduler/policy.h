@@ -0,0 +1,411 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <deque>
+#include <list>
+#include <set>
+#include <tuple>
+
+#include "utils.h"
+
+#define MLFQ_LEVELS 3
+#define MLFQ_BOOST_INTERVAL 100
+#define CFS_TARGET_LATENCY 20
+#define CFS_MIN_GRANULARITY 2
+#define PRIORITY_AGING_INTERVAL 20
+#define PRIORITY_WORDS ((PRIORITY_LEVELS + 63) / 64)
+
+// Decides which ready process runs next and for how long. The kernel owns
+// dispatching, burst accounting and IO; a policy only orders the ready set.
+class SchedulingPolicy {
+public:
+    virtual ~SchedulingPolicy() {}
+
+    virtual const char* name() const = 0;
+
+    // A process becomes ready for the first time.
+    virtual void enqueue(PartialUserProcess* process) = 0;
+    // The running process used up its time slice.
+    virtual void onPreempt(PartialUserProcess* process) { enqueue(process); }
+    // A process finished its IO burst and is ready again.
+    virtual void onIoReturn(PartialUserProcess* process) { enqueue(process); }
+    // The running process consumed `ticks` of CPU time.
+    virtual void onRun(PartialUserProcess* process, unsigned ticks) {}
+
+    virtual PartialUserProcess* pickNext() = 0;
+    // Removes the ready process allowed on `cpu` that would be picked last,
+    // for an idle CPU to run. NULL if there is none.
+    virtual PartialUserProcess* steal(int cpu) = 0;
+
+    // Time slice granted on dispatch, 0 runs the process until it blocks or ends.
+    virtual unsigned timeSlice(const PartialUserProcess* process) const = 0;
+    // Whether a ready process should take the CPU from `current` right now.
+    virtual bool shouldPreempt(const PartialUserProcess* current) const { return false; }
+    // Ticks `current` can run before shouldPreempt may change its answer
+    // without a process becoming ready, -1 if it never does.
+    virtual int ticksUntilPreemptCheck(const PartialUserProcess* current) const { return -1; }
+
+    virtual bool empty() const = 0;
+    virtual size_t size() const = 0;
+    // Ready processes in the order they would be picked, for logging.
+    virtual std::vector<PartialUserProcess*> snapshot() const = 0;
+};
+
+class RoundRobinPolicy : public SchedulingPolicy {
+public:
+    explicit RoundRobinPolicy(unsigned timeQuantum) : timeQuantum(timeQuantum) {}
+
+    const char* name() const override { return "RR"; }
+
+    void enqueue(PartialUserProcess* process) override { readyQueue.push_back(process); }
+
+    PartialUserProcess* pickNext() override {
+        PartialUserProcess* process = readyQueue.front();
+        readyQueue.pop_front();
+        return process;
+    }
+
+    PartialUserProcess* steal(int cpu) override {
+        for(auto it = readyQueue.rbegin(); it != readyQueue.rend(); ++it) {
+            if(allowedOn(*it, cpu)) {
+                PartialUserProcess* process = *it;
+                readyQueue.erase(std::next(it).base());
+                return process;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned timeSlice(const PartialUserProcess* process) const override { return timeQuantum; }
+
+    bool empty() const override { return readyQueue.empty(); }
+    size_t size() const override { return readyQueue.size(); }
+
+    std::vector<PartialUserProcess*> snapshot() const override {
+        return std::vector<PartialUserProcess*>(readyQueue.begin(), readyQueue.end());
+    }
+
+private:
+    unsigned timeQuantum;
+    std::deque<PartialUserProcess*> readyQueue;
+};
+
+// Shortest job first on the remaining CPU burst. Non-preemptive by default;
+// the preemptive variant (SRTF) gives up the CPU as soon as a shorter job waits.
+class ShortestJobFirstPolicy : public SchedulingPolicy {
+public:
+    explicit ShortestJobFirstPolicy(bool preemptive) : preemptive(preemptive) {}
+
+    const char* name() const override { return preemptive ? "SRTF" : "SJF"; }
+
+    void enqueue(PartialUserProcess* process) override {
+        readySet.insert({process->remainingCpuBurst, process->pid, process});
+    }
+
+    PartialUserProcess* pickNext() override {
+        PartialUserProcess* process = std::get<2>(*readySet.begin());
+        readySet.erase(readySet.begin());
+        return process;
+    }
+
+    PartialUserProcess* steal(int cpu) override {
+        for(auto it = readySet.rbegin(); it != readySet.rend(); ++it) {
+            PartialUserProcess* process = std::get<2>(*it);
+            if(allowedOn(process, cpu)) {
+                readySet.erase(std::next(it).base());
+                return process;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned timeSlice(const PartialUserProcess* process) const override { return 0; }
+
+    bool shouldPreempt(const PartialUserProcess* current) const override {
+        return preemptive && !readySet.empty() && std::get<0>(*readySet.begin()) < current->remainingCpuBurst;
+    }
+
+    bool empty() const override { return readySet.empty(); }
+    size_t size() const override { return readySet.size(); }
+
+    std::vector<PartialUserProcess*> snapshot() const override {
+        std::vector<PartialUserProcess*> processes;
+        for(auto& entry : readySet) processes.push_back(std::get<2>(entry));
+        return processes;
+    }
+
+private:
+    bool preemptive;
+    std::set<std::tuple<int, int, PartialUserProcess*>> readySet;
+};
+
+// Multi-level feedback queue. A process that uses its whole slice drops one
+// level (slices double per level); returning from IO keeps the level. Every
+// MLFQ_BOOST_INTERVAL ticks of CPU time all processes go back to the top:
+// the lower queues are spliced up and an epoch bump resets every stored level.
+class MultiLevelFeedbackQueuePolicy : public SchedulingPolicy {
+public:
+    explicit MultiLevelFeedbackQueuePolicy(unsigned timeQuantum) : timeQuantum(timeQuantum) {}
+
+    const char* name() const override { return "MLFQ"; }
+
+    void enqueue(PartialUserProcess* process) override {
+        levels[levelOf(process)].push_back(process);
+        readyCount++;
+    }
+
+    void onPreempt(PartialUserProcess* process) override {
+        process->queueLevel = std::min(levelOf(process) + 1, MLFQ_LEVELS - 1);
+        process->queueEpoch = epoch;
+        enqueue(process);
+    }
+
+    void onRun(PartialUserProcess* process, unsigned ticks) override {
+        ticksSinceBoost += ticks;
+        if(ticksSinceBoost >= MLFQ_BOOST_INTERVAL) {
+            ticksSinceBoost %= MLFQ_BOOST_INTERVAL;
+            for(int level = 1; level < MLFQ_LEVELS; level++) {
+                levels[0].splice(levels[0].end(), levels[level]);
+            }
+            epoch++;
+        }
+    }
+
+    PartialUserProcess* pickNext() override {
+        for(auto& level : levels) {
+            if(!level.empty()) {
+                PartialUserProcess* process = level.front();
+                level.pop_front();
+                readyCount--;
+                return process;
+            }
+        }
+        return NULL;
+    }
+
+    PartialUserProcess* steal(int cpu) override {
+        for(int level = MLFQ_LEVELS - 1; level >= 0; level--) {
+            for(auto it = levels[level].rbegin(); it != levels[level].rend(); ++it) {
+                if(allowedOn(*it, cpu)) {
+                    PartialUserProcess* process = *it;
+                    levels[level].erase(std::next(it).base());
+                    readyCount--;
+                    return process;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    unsigned timeSlice(const PartialUserProcess* process) const override {
+        return timeQuantum << levelOf(process);
+    }
+
+    bool empty() const override { return readyCount == 0; }
+    size_t size() const override { return readyCount; }
+
+    std::vector<PartialUserProcess*> snapshot() const override {
+        std::vector<PartialUserProcess*> processes;
+        for(auto& level : levels) processes.insert(processes.end(), level.begin(), level.end());
+        return processes;
+    }
+
+private:
+    unsigned timeQuantum;
+    unsigned epoch=1;
+    unsigned ticksSinceBoost=0;
+    size_t readyCount=0;
+    std::list<PartialUserProcess*> levels[MLFQ_LEVELS];
+
+    int levelOf(const PartialUserProcess* process) const {
+        return process->queueEpoch == epoch ? process->queueLevel : 0;
+    }
+};
+
+// Completely-fair style: the ready set is a balanced tree ordered by virtual
+// runtime and the leftmost process runs for an equal share of the target
+// latency. Waking processes are placed no earlier than the minimum vruntime
+// so a long sleeper cannot monopolize the CPU.
+class FairSharePolicy : public SchedulingPolicy {
+public:
+    const char* name() const override { return "CFS"; }
+
+    void enqueue(PartialUserProcess* process) override {
+        process->vruntime = std::max(process->vruntime, minVruntime);
+        readySet.insert({process->vruntime, process->pid, process});
+    }
+
+    void onPreempt(PartialUserProcess* process) override {
+        readySet.insert({process->vruntime, process->pid, process});
+    }
+
+    void onRun(PartialUserProcess* process, unsigned ticks) override {
+        process->vruntime += ticks;
+        unsigned long long leftmost = readySet.empty() ? process->vruntime : std::get<0>(*readySet.begin());
+        minVruntime = std::max(minVruntime, std::min(process->vruntime, leftmost));
+    }
+
+    PartialUserProcess* pickNext() override {
+        PartialUserProcess* process = std::get<2>(*readySet.begin());
+        readySet.erase(readySet.begin());
+        return process;
+    }
+
+    PartialUserProcess* steal(int cpu) override {
+        for(auto it = readySet.rbegin(); it != readySet.rend(); ++it) {
+            PartialUserProcess* process = std::get<2>(*it);
+            if(allowedOn(process, cpu)) {
+                readySet.erase(std::next(it).base());
+                return process;
+            }
+        }
+        return NULL;
+    }
+
+    unsigned timeSlice(const PartialUserProcess* process) const override {
+        return std::max<unsigned>(CFS_MIN_GRANULARITY, CFS_TARGET_LATENCY / (readySet.size() + 1));
+    }
+
+    bool empty() const override { return readySet.empty(); }
+    size_t size() const override { return readySet.size(); }
+
+    std::vector<PartialUserProcess*> snapshot() const override {
+        std::vector<PartialUserProcess*> processes;
+        for(auto& entry : readySet) processes.push_back(std::get<2>(entry));
+        return processes;
+    }
+
+private:
+    unsigned long long minVruntime=0;
+    std::set<std::tuple<unsigned long long, int, PartialUserProcess*>> readySet;
+};
+
+// O(1) priority scheduling: one FIFO per priority level and a bitmap of the
+// non-empty levels, so picking the next process is a find-first-set over
+// PRIORITY_WORDS words whatever the number of ready processes. A process
+// enters at priority + nice and runs at the level it was picked from until a
+// higher level has a ready process. Every PRIORITY_AGING_INTERVAL ticks of
+// CPU time each level is spliced one level up, so a waiting process reaches
+// the top within PRIORITY_LEVELS intervals; once it leaves the CPU it drops
+// back to its own priority.
+class PriorityPolicy : public SchedulingPolicy {
+public:
+    explicit PriorityPolicy(unsigned timeQuantum) : timeQuantum(timeQuantum) {}
+
+    const char* name() const override { return "PRIO"; }
+
+    void enqueue(PartialUserProcess* process) override {
+        int level = staticLevel(process);
+        levels[level].push_back(process);
+        bitmap[level / 64] |= 1ULL << (level % 64);
+        readyCount++;
+    }
+
+    void onRun(PartialUserProcess* process, unsigned ticks) override {
+        ticksSinceAging += ticks;
+        for(; ticksSinceAging >= PRIORITY_AGING_INTERVAL; ticksSinceAging -= PRIORITY_AGING_INTERVAL) {
+            age();
+            // The running process ages along, so equals do not preempt it.
+            process->queueLevel = std::max(process->queueLevel - 1, 0);
+        }
+    }
+
+    PartialUserProcess* pickNext() override {
+        int level = firstLevel();
+        if(level < 0) return NULL;
+        PartialUserProcess* process = levels[level].front();
+        levels[level].pop_front();
+        process->queueLevel = level;
+        clearIfEmpty(level);
+        readyCount--;
+        return process;
+    }
+
+    PartialUserProcess* steal(int cpu) override {
+        for(int level = PRIORITY_LEVELS - 1; level >= 0; level--) {
+            for(auto it = levels[level].rbegin(); it != levels[level].rend(); ++it) {
+                if(allowedOn(*it, cpu)) {
+                    PartialUserProcess* process = *it;
+                    levels[level].erase(std::next(it).base());
+                    process->queueLevel = level;
+                    clearIfEmpty(level);
+                    readyCount--;
+                    return process;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    unsigned timeSlice(const PartialUserProcess* process) const override { return timeQuantum; }
+
+    bool shouldPreempt(const PartialUserProcess* current) const override {
+        int level = firstLevel();
+        return level >= 0 && level < current->queueLevel;
+    }
+
+    // Aging only moves ready processes up at the end of an interval.
+    int ticksUntilPreemptCheck(const PartialUserProcess* current) const override {
+        return readyCount ? PRIORITY_AGING_INTERVAL - ticksSinceAging : -1;
+    }
+
+    bool empty() const override { return readyCount == 0; }
+    size_t size() const override { return readyCount; }
+
+    std::vector<PartialUserProcess*> snapshot() const override {
+        std::vector<PartialUserProcess*> processes;
+        for(auto& level : levels) processes.insert(processes.end(), level.begin(), level.end());
+        return processes;
+    }
+
+private:
+    unsigned timeQuantum;
+    unsigned ticksSinceAging=0;
+    size_t readyCount=0;
+    uint64_t bitmap[PRIORITY_WORDS] = {};
+    std::list<PartialUserProcess*> levels[PRIORITY_LEVELS];
+
+    static int staticLevel(const PartialUserProcess* process) {
+        return std::clamp(process->priority + process->nice, 0, PRIORITY_LEVELS - 1);
+    }
+
+    int firstLevel() const {
+        for(int word = 0; word < PRIORITY_WORDS; word++) {
+            if(bitmap[word]) return word * 64 + __builtin_ctzll(bitmap[word]);
+        }
+        return -1;
+    }
+
+    void clearIfEmpty(int level) {
+        if(levels[level].empty()) bitmap[level / 64] &= ~(1ULL << (level % 64));
+    }
+
+    // Every non-empty level joins the one above it, behind the processes
+    // already waiting there; the bitmap shifts down by one bit.
+    void age() {
+        for(int word = 0; word < PRIORITY_WORDS; word++) {
+            for(uint64_t bits = bitmap[word]; bits; bits &= bits - 1) {
+                int level = word * 64 + __builtin_ctzll(bits);
+                if(level > 0) levels[level - 1].splice(levels[level - 1].end(), levels[level]);
+            }
+        }
+        bool top = bitmap[0] & 1;
+        for(int word = 0; word < PRIORITY_WORDS; word++) {
+            uint64_t carry = word + 1 < PRIORITY_WORDS ? bitmap[word + 1] << 63 : 0;
+            bitmap[word] = (bitmap[word] >> 1) | carry;
+        }
+        if(top) bitmap[0] |= 1;
+    }
+};
+
+std::unique_ptr<SchedulingPolicy> makeSchedulingPolicy(const std::string& name, unsigned timeQuantum) {
+    if(name == "sjf") return std::make_unique<ShortestJobFirstPolicy>(false);
+    if(name == "srtf") return std::make_unique<ShortestJobFirstPolicy>(true);
+    if(name == "mlfq") return std::make_unique<MultiLevelFeedbackQueuePolicy>(timeQuantum);
+    if(name == "cfs") return std::make_unique<FairSharePolicy>();
+    if(name == "prio") return std::make_unique<PriorityPolicy>(timeQuantum);
+    if(name != "rr") std::cerr << ERROR_LOG_PREFIX << "Unknown policy " << name << ", use rr." << std::endl;
+    return std::make_unique<RoundRobinPolicy>(timeQuantum);
+}
+
+#endif // POLICY_H
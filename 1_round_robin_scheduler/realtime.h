@@ -0,0 +1,202 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include "log.h"
+#include "utils.h"
+
+// Real-time jobs may use REALTIME_RUNTIME of every REALTIME_WINDOW ticks of
+// a CPU, so best-effort processes keep running on an overloaded one.
+#define REALTIME_WINDOW 100
+#define REALTIME_RUNTIME 95
+
+// One release of a real-time task and the ticks it still has to run.
+struct RealTimeJob {
+    unsigned deadline;
+    unsigned release;
+    unsigned remaining;
+    int task;
+};
+
+// Earlier absolute deadline first, then earlier release, then task index.
+struct LaterDeadline {
+    bool operator()(const RealTimeJob& a, const RealTimeJob& b) const {
+        return std::tie(a.deadline, a.release, a.task) > std::tie(b.deadline, b.release, b.task);
+    }
+};
+
+// Earliest-deadline-first class above the best-effort policies. Tasks are
+// partitioned onto CPUs when the kernel starts: first fit in order of
+// decreasing density wcet / min(deadline, period), admitted while the
+// densities on a CPU add up to at most the runtime share, which EDF can
+// always schedule. A task that fits no CPU is rejected, or without the
+// admission test put on the least loaded CPU, where jobs may miss their
+// deadlines. Released jobs wait in a per-CPU heap ordered by absolute
+// deadline; the CPU runs the top job whenever the heap is not empty and the
+// window's runtime is not used up, and the best-effort process waits.
+class RealTimeClass {
+public:
+    RealTimeClass(const std::vector<RealTimeTaskConfig>& configs, int numCpus, bool admission) : cpus(numCpus) {
+        std::vector<int> order;
+        for(int i = 0; i < (int)configs.size(); i++) order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&configs](int a, int b) { return density(configs[a]) > density(configs[b]); });
+        std::vector<double> load(numCpus, 0.0);
+        for(int index : order) {
+            const RealTimeTaskConfig& config = configs[index];
+            int cpu = 0;
+            while(cpu < numCpus && load[cpu] + density(config) > (double)REALTIME_RUNTIME / REALTIME_WINDOW + 1e-9) cpu++;
+            if(cpu == numCpus && !admission) {
+                cpu = std::min_element(load.begin(), load.end()) - load.begin();
+            } else if(cpu == numCpus) {
+                std::cerr << ERROR_LOG_PREFIX << "Real-time task " << index << " (density " << density(config) << ") fits no CPU, rejected." << std::endl;
+                rejected++;
+                continue;
+            }
+            load[cpu] += density(config);
+            tasks.push_back(Task{index, config, cpu, RandomStream(RANDOM_REALTIME, index)});
+            releases.push({0, (int)tasks.size() - 1});
+            LOG(SCHED, INFO) << "Real-time task " << index << " admitted on CPU " << cpu << ", density " << density(config) << std::endl;
+        }
+        for(int cpu = 0; cpu < numCpus; cpu++) cpus[cpu].admittedDensity = load[cpu];
+    }
+
+    bool enabled() const { return !tasks.empty() || rejected > 0; }
+
+    // Releases every job due by `now` onto the heap of its task's CPU.
+    void releaseOnTick(unsigned now) {
+        while(!releases.empty() && releases.top().first <= now) {
+            auto [release, index] = releases.top();
+            releases.pop();
+            Task& task = tasks[index];
+            std::vector<RealTimeJob>& ready = cpus[task.cpu].ready;
+            ready.push_back({release + task.config.deadline, release, task.config.wcet, index});
+            std::push_heap(ready.begin(), ready.end(), LaterDeadline());
+            released++;
+            LOG(SCHED, DEBUG) << "Real-time task " << task.index << " released a job due at " << release + task.config.deadline << std::endl;
+            unsigned jitter = task.config.jitter ? task.jitter.range(0, task.config.jitter) : 0;
+            releases.push({release + task.config.period + jitter, index});
+        }
+    }
+
+    bool hasReady(int cpu) const { return !cpus[cpu].ready.empty(); }
+
+    // A job is ready and the CPU may run it during tick `now`.
+    bool runnable(int cpu, unsigned now) const { return hasReady(cpu) && runtimeLeft(cpu, now) > 0; }
+
+    const RealTimeJob& current(int cpu) const { return cpus[cpu].ready.front(); }
+    int taskIndex(const RealTimeJob& job) const { return tasks[job.task].index; }
+
+    // Runs the earliest-deadline job of `cpu` during tick `now`.
+    void runTick(int cpu, unsigned now) {
+        std::vector<RealTimeJob>& ready = cpus[cpu].ready;
+        charge(cpu, now, 1);
+        if(--ready.front().remaining > 0) return;
+        std::pop_heap(ready.begin(), ready.end(), LaterDeadline());
+        finish(ready.back(), now + 1);
+        ready.pop_back();
+    }
+
+    // Ticks until the next release is due, -1 if there is none.
+    int ticksUntilRelease(unsigned now) const {
+        if(releases.empty()) return -1;
+        return releases.top().first > now ? releases.top().first - now : 0;
+    }
+
+    // Ticks the current job of `cpu` runs from `now` on before the tick it
+    // finishes in, uses up the runtime or the window ends in.
+    int plainTicks(int cpu, unsigned now) const {
+        unsigned windowLeft = REALTIME_WINDOW - now % REALTIME_WINDOW;
+        return std::min({current(cpu).remaining, runtimeLeft(cpu, now), windowLeft}) - 1;
+    }
+
+    // Ticks until a throttled CPU with ready jobs may run them again, -1 if
+    // it is not throttled.
+    int ticksUntilUnthrottled(int cpu, unsigned now) const {
+        if(!hasReady(cpu) || runtimeLeft(cpu, now) > 0) return -1;
+        return REALTIME_WINDOW - now % REALTIME_WINDOW;
+    }
+
+    void fastForward(int cpu, unsigned now, unsigned ticks) {
+        cpus[cpu].ready.front().remaining -= ticks;
+        charge(cpu, now, ticks);
+    }
+
+    unsigned busyTicks(int cpu) const { return cpus[cpu].busyTicks; }
+
+    // Jobs still pending past their deadline when the simulation ends count
+    // as misses too, without a lateness.
+    void stat(unsigned totalTime) const {
+        unsigned long long overdue = 0;
+        for(auto& cpu : cpus) {
+            for(auto& job : cpu.ready) overdue += job.deadline < totalTime;
+        }
+        printf("\t%-20s | %-10zu\n", "RT Tasks Admitted", tasks.size());
+        printf("\t%-20s | %-10u\n", "RT Tasks Rejected", rejected);
+        for(int cpu = 0; cpu < (int)cpus.size(); cpu++) {
+            printf("\t%-20s | %-10.2f\n", ("CPU " + std::to_string(cpu) + " RT Admitted %").c_str(), cpus[cpu].admittedDensity * 100);
+        }
+        printf("\t%-20s | %-10llu\n", "RT Jobs Released", released);
+        printf("\t%-20s | %-10zu\n", "RT Jobs Completed", lateness.size());
+        printf("\t%-20s | %-10llu\n", "RT Deadline Misses", missed + overdue);
+    }
+
+    LatencySummary latenessSummary() const { return summarizeLatencies(lateness); }
+
+private:
+    struct Task {
+        int index;
+        RealTimeTaskConfig config;
+        int cpu;
+        RandomStream jitter;
+    };
+    struct CpuJobs {
+        std::vector<RealTimeJob> ready;
+        unsigned busyTicks = 0;
+        double admittedDensity = 0;
+        unsigned window = 0;
+        unsigned windowTicks = 0;
+    };
+
+    std::vector<Task> tasks;
+    std::vector<CpuJobs> cpus;
+    // (release tick, task) of every task's next job.
+    typedef std::pair<unsigned, int> Release;
+    std::priority_queue<Release, std::vector<Release>, std::greater<Release>> releases;
+    unsigned rejected = 0;
+    unsigned long long released = 0;
+    unsigned long long missed = 0;
+    // Finish minus deadline of every completed job, negative if early.
+    std::vector<int> lateness;
+
+    unsigned runtimeLeft(int cpu, unsigned now) const {
+        const CpuJobs& jobs = cpus[cpu];
+        return jobs.window == now / REALTIME_WINDOW ? REALTIME_RUNTIME - std::min<unsigned>(jobs.windowTicks, REALTIME_RUNTIME) : REALTIME_RUNTIME;
+    }
+
+    // Ticks from `now` on, all within its window.
+    void charge(int cpu, unsigned now, unsigned ticks) {
+        CpuJobs& jobs = cpus[cpu];
+        if(jobs.window != now / REALTIME_WINDOW) {
+            jobs.window = now / REALTIME_WINDOW;
+            jobs.windowTicks = 0;
+        }
+        jobs.windowTicks += ticks;
+        jobs.busyTicks += ticks;
+    }
+
+    static double density(const RealTimeTaskConfig& config) {
+        return (double)config.wcet / std::min(config.deadline, config.period);
+    }
+
+    void finish(const RealTimeJob& job, unsigned finishTick) {
+        int late = (int)finishTick - (int)job.deadline;
+        lateness.push_back(late);
+        if(late > 0) {
+            missed++;
+            LOG(SCHED, WARN) << "Real-time task " << tasks[job.task].index << " missed its deadline " << job.deadline << " by " << late << " ticks" << std::endl;
+        } else {
+            LOG(SCHED, DEBUG) << "Real-time task " << tasks[job.task].index << " finished a job at " << finishTick << ", deadline " << job.deadline << std::endl;
+        }
+    }
+};
+
+#endif // REALTIME_H
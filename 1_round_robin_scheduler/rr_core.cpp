@@ -1,40 +1,126 @@
 #include "kernel.h"
+#include "pool.h"
+#include "simulation.h"
+#include "transport.h"
 #include "user.h"
 #include "utils.h"
 
-int main() {
-  key_t key = ftok(MESSAGE_QUEUE_NAME, 65);
+int main(int argc, char *argv[]) {
+  SimulationOptions options = parseSimulationOptions(argc, argv);
+  if (options.seed) {
+    seedRandom(*options.seed);
+  }
+  logThresholds = options.logLevels;
+  if (options.inProcess) {
+    runInProcess(options);
+    return 0;
+  }
 
-  int msgid = msgget(key, 0666 | IPC_CREAT);
-  clearMessageQueue(msgid);
+  bool fromWorkload = !options.workloadPath.empty();
+  std::unique_ptr<MessageQueueTransport> queueTransport;
+  std::unique_ptr<SharedMemoryTransport> sharedTransport;
+  if (options.transport == "shm") {
+    // The number of workload processes is only known once they arrived.
+    sharedTransport = std::make_unique<SharedMemoryTransport>(
+        getpid(), fromWorkload ? SHM_MAX_PEERS : options.numProcesses);
+  } else {
+    key_t key = ftok(MESSAGE_QUEUE_NAME, 65);
+    int msgid = msgget(key, 0666 | IPC_CREAT);
+    queueTransport = std::make_unique<MessageQueueTransport>(msgid);
+    queueTransport->clear();
+  }
+  Transport &transport = sharedTransport
+                             ? static_cast<Transport &>(*sharedTransport)
+                             : *queueTransport;
 
+  ObjectPool<PartialUserProcess> processPool;
   std::vector<PartialUserProcess *> userProcesses;
+  // Children holding a shared slot.
+  std::vector<PartialUserProcess *> boundChildren;
 
-  pid_t pid;
-  for (int i = 0; i < NUM_CHILD_PROCESSES; i++) {
-    int randomCpuBurst = randomRange(5, 30);
-    pid = fork();
+  // Frees the slots of the children the kernel finished. Their last command
+  // went out in an earlier tick, so they exit promptly; the kernel's final
+  // waitpid then finds them reaped already.
+  auto reclaimSlots = [&]() {
+    auto bound = std::remove_if(
+        boundChildren.begin(), boundChildren.end(),
+        [&](PartialUserProcess *child) {
+          if (child->completionTick < 0) {
+            return false;
+          }
+          waitpid(child->pid, nullptr, 0);
+          return sharedTransport->releasePeer(child->pid);
+        });
+    boundChildren.erase(bound, boundChildren.end());
+  };
+
+  auto spawn = [&](int cpuBurst,
+                   const WorkloadEntry *entry) -> PartialUserProcess * {
+    int slot = sharedTransport ? sharedTransport->reserveSlot() : 0;
+    if (slot < 0) {
+      reclaimSlots();
+      slot = sharedTransport->reserveSlot();
+    }
+    if (slot < 0) {
+      std::cerr << ERROR_LOG_PREFIX << "No shared ring left for a new process"
+                << std::endl;
+      return NULL;
+    }
+    uint64_t streamId = userProcesses.size();
+    pid_t pid = fork();
     if (pid == 0) { // child process
-      UserProcess userProcess(getpid(), randomCpuBurst, msgid);
+      if (sharedTransport) {
+        sharedTransport->becomePeer(slot);
+      }
+      UserProcess userProcess(getpid(), cpuBurst, transport, getppid(),
+                              options, streamId);
+      if (entry) {
+        userProcess.followWorkload(*entry);
+      }
       userProcess.run();
       exit(0);
-    } else if (pid > 0) { // parent process
-      PartialUserProcess *partialUserProcess =
-          new PartialUserProcess{pid, randomCpuBurst, 0};
-      userProcesses.push_back(partialUserProcess);
-    } else {
+    } else if (pid < 0) {
       std::cerr << ERROR_LOG_PREFIX << "Fork failed" << std::endl;
+      return NULL;
     }
+    // parent process
+    if (sharedTransport) {
+      sharedTransport->bindPeer(slot, pid);
+    }
+    PartialUserProcess *partialUserProcess =
+        processPool.get(processPool.allocate(pid, cpuBurst, 0));
+    partialUserProcess->priority = entry ? entry->priority : DEFAULT_PRIORITY;
+    userProcesses.push_back(partialUserProcess);
+    if (sharedTransport) {
+      boundChildren.push_back(partialUserProcess);
+    }
+    return partialUserProcess;
+  };
+
+  WorkloadReader workload;
+  if (fromWorkload && !workload.open(options.workloadPath)) {
+    return 1;
+  }
+  for (int i = 0; !fromWorkload && i < options.numProcesses; i++) {
+    RandomStream bursts(RANDOM_BURSTS, i);
+    spawn(bursts.range(options.minCpuBurst, options.maxCpuBurst), nullptr);
   }
 
-  KernelProcess kernel(TIME_QUANTUM, userProcesses, msgid);
+  KernelProcess kernel(options.timeQuantum, userProcesses, transport, getpid(),
+                       options);
+  if (fromWorkload) {
+    kernel.setWorkload(&workload, [&spawn](const WorkloadEntry &entry) {
+      return spawn(entry.totalCpuBurst(), &entry);
+    });
+  }
   kernel.run();
   kernel.exit();
 
-  for (auto *user : userProcesses) {
-    delete user;
+  if (sharedTransport) {
+    sharedTransport->close();
+  } else {
+    queueTransport->clear();
   }
-  clearMessageQueue(msgid);
 
   return 0;
-}
\ No newline at end of file
+}
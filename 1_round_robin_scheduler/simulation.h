@@ -0,0 +1,65 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "kernel.h"
+#include "pool.h"
+#include "transport.h"
+#include "user.h"
+#include "utils.h"
+
+#define IN_PROCESS_KERNEL_PID 1
+
+// Every user process lives in this address space and is driven by the
+// messages the kernel sends it, so the simulation runs on a single thread.
+SimulationResult runInProcess(const SimulationOptions &options) {
+  logThresholds = options.logLevels;
+  LocalTransport transport;
+  ObjectPool<PartialUserProcess> processPool;
+  std::vector<PartialUserProcess *> userProcesses;
+  std::vector<std::unique_ptr<UserProcess>> inProcessUsers;
+
+  auto spawn = [&](int cpuBurst, const WorkloadEntry *entry) {
+    pid_t pid = IN_PROCESS_KERNEL_PID + 1 + userProcesses.size();
+    inProcessUsers.push_back(std::make_unique<UserProcess>(
+        pid, cpuBurst, transport, IN_PROCESS_KERNEL_PID, options,
+        userProcesses.size()));
+    UserProcess *userProcess = inProcessUsers.back().get();
+    if (entry) {
+      userProcess->followWorkload(*entry);
+    }
+    transport.attach(pid, [&transport, userProcess, pid](const message &msg,
+                                                         size_t length) {
+      userProcess->onMessage(msg, length);
+      if (userProcess->isTerminated()) {
+        transport.detach(pid);
+      }
+    });
+    userProcesses.push_back(
+        processPool.get(processPool.allocate(pid, cpuBurst, 0)));
+    userProcesses.back()->priority = entry ? entry->priority : DEFAULT_PRIORITY;
+    return userProcesses.back();
+  };
+
+  WorkloadReader workload;
+  bool fromWorkload = !options.workloadPath.empty();
+  if (fromWorkload && !workload.open(options.workloadPath)) {
+    return {};
+  }
+  for (int i = 0; !fromWorkload && i < options.numProcesses; i++) {
+    RandomStream bursts(RANDOM_BURSTS, i);
+    spawn(bursts.range(options.minCpuBurst, options.maxCpuBurst), nullptr);
+  }
+
+  KernelProcess kernel(options.timeQuantum, userProcesses, transport,
+                       IN_PROCESS_KERNEL_PID, options);
+  if (fromWorkload) {
+    kernel.setWorkload(&workload, [&spawn](const WorkloadEntry &entry) {
+      return spawn(entry.totalCpuBurst(), &entry);
+    });
+  }
+  kernel.run();
+  kernel.exit();
+  return kernel.result();
+}
+
+#endif // SIMULATION_H
@@ -0,0 +1,258 @@
+#include "simulation.h"
+#include "utils.h"
+
+// Runs the in-process, fast-forward simulation once for every combination of
+// the given parameter ranges and prints one row per run. Runs are spread over
+// worker processes (one per host core by default); each run reseeds the
+// random generator, so a row only depends on its own parameters.
+
+struct SweepOptions {
+  std::vector<long long> quantums = {TIME_QUANTUM};
+  std::vector<long long> processCounts = {NUM_CHILD_PROCESSES};
+  std::vector<long long> ioProbabilities = {IO_BURST_PROBABILITY};
+  std::vector<std::pair<long long, long long>> cpuBursts = {
+      {MIN_CPU_BURST, MAX_CPU_BURST}};
+  std::vector<long long> seeds = {1};
+  std::string policy = "rr";
+  int numCpus = 1;
+  SwitchCost switchCost;
+  int jobs = std::max(1u, std::thread::hardware_concurrency());
+  bool json = false;
+};
+
+struct SweepRun {
+  SimulationOptions options;
+  SimulationResult result;
+};
+
+// "<value>" or "<first>:<last>[:<step>]".
+std::vector<long long> parseRange(const std::string &value) {
+  std::vector<long long> values;
+  std::stringstream stream(value);
+  std::string part;
+  std::vector<long long> parts;
+  while (std::getline(stream, part, ':')) {
+    parts.push_back(strtoll(part.c_str(), nullptr, 0));
+  }
+  if (parts.size() == 1) {
+    return parts;
+  }
+  if (parts.size() < 2 || parts.size() > 3 || (parts.size() == 3 && parts[2] <= 0)) {
+    std::cerr << ERROR_LOG_PREFIX << "Range " << value
+              << " is not <first>:<last>[:<step>], ignored." << std::endl;
+    return values;
+  }
+  long long step = parts.size() == 3 ? parts[2] : 1;
+  for (long long v = parts[0]; v <= parts[1]; v += step) {
+    values.push_back(v);
+  }
+  return values;
+}
+
+// Comma separated "<min>:<max>" uniform CPU burst distributions.
+std::vector<std::pair<long long, long long>> parseBursts(const std::string &value) {
+  std::vector<std::pair<long long, long long>> bursts;
+  std::stringstream stream(value);
+  std::string part;
+  while (std::getline(stream, part, ',')) {
+    long long minBurst, maxBurst;
+    if (!parsePair(part, minBurst, maxBurst) || minBurst < 1 || minBurst > maxBurst) {
+      std::cerr << ERROR_LOG_PREFIX << "CPU burst " << part
+                << " is not <min>:<max>, ignored." << std::endl;
+      continue;
+    }
+    bursts.push_back({minBurst, maxBurst});
+  }
+  return bursts;
+}
+
+SweepOptions parseSweepOptions(int argc, char *argv[]) {
+  SweepOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--json") {
+      options.json = true;
+    } else if (arg == "--csv") {
+      options.json = false;
+    } else if (arg == "--quantum" && i + 1 < argc) {
+      options.quantums = parseRange(argv[++i]);
+    } else if (arg == "--processes" && i + 1 < argc) {
+      options.processCounts = parseRange(argv[++i]);
+    } else if (arg == "--io-probability" && i + 1 < argc) {
+      options.ioProbabilities = parseRange(argv[++i]);
+    } else if (arg == "--cpu-burst" && i + 1 < argc) {
+      options.cpuBursts = parseBursts(argv[++i]);
+    } else if (arg == "--seeds" && i + 1 < argc) {
+      options.seeds = parseRange(argv[++i]);
+    } else if (arg == "--policy" && i + 1 < argc) {
+      options.policy = argv[++i];
+    } else if (arg == "--cpus" && i + 1 < argc) {
+      options.numCpus = std::min(MAX_CPUS, std::max(1, atoi(argv[++i])));
+    } else if (arg == "--switch-cost" && i + 1 < argc) {
+      if (!parseSwitchCost(argv[++i], options.switchCost)) {
+        std::cerr << ERROR_LOG_PREFIX << "Switch cost " << argv[i]
+                  << " is not <fixed>[:<warm-up %>[:<max warm-up>]], ignored."
+                  << std::endl;
+      }
+    } else if (arg == "--jobs" && i + 1 < argc) {
+      options.jobs = std::max(1, atoi(argv[++i]));
+    } else {
+      std::cerr << ERROR_LOG_PREFIX << "Unknown option " << arg << ", ignored."
+                << std::endl;
+    }
+  }
+  return options;
+}
+
+std::vector<SweepRun> expandRuns(const SweepOptions &sweep) {
+  std::vector<SweepRun> runs;
+  for (long long quantum : sweep.quantums)
+    for (long long processes : sweep.processCounts)
+      for (long long probability : sweep.ioProbabilities)
+        for (auto &burst : sweep.cpuBursts)
+          for (long long seed : sweep.seeds) {
+            SweepRun run{};
+            run.options.fastForward = true;
+            run.options.inProcess = true;
+            run.options.policy = sweep.policy;
+            run.options.numCpus = sweep.numCpus;
+            run.options.switchCost = sweep.switchCost;
+            run.options.timeQuantum = std::max(1LL, quantum);
+            run.options.numProcesses = std::max(1LL, processes);
+            run.options.ioBurstProbability = std::clamp(probability, 0LL, 100LL);
+            run.options.minCpuBurst = burst.first;
+            run.options.maxCpuBurst = burst.second;
+            run.options.seed = seed;
+            // The log goes nowhere, so it is not even formatted.
+            run.options.logLevels.fill(LogLevel::OFF);
+            runs.push_back(run);
+          }
+  return runs;
+}
+
+// Runs `runs[index]` in a forked worker whose simulation log is discarded.
+// The result comes back through `fd` as (index, SimulationResult).
+pid_t startWorker(const std::vector<SweepRun> &runs, size_t index, int fd) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  if (!freopen("/dev/null", "w", stdout)) {
+    _exit(1);
+  }
+  const SimulationOptions &options = runs[index].options;
+  seedRandom(*options.seed);
+  SimulationResult result = runInProcess(options);
+  fflush(stdout);
+  char record[sizeof(size_t) + sizeof(SimulationResult)];
+  memcpy(record, &index, sizeof(size_t));
+  memcpy(record + sizeof(size_t), &result, sizeof(SimulationResult));
+  // Records are smaller than PIPE_BUF, so concurrent writes never interleave.
+  ssize_t written = write(fd, record, sizeof(record));
+  _exit(written == (ssize_t)sizeof(record) ? 0 : 1);
+}
+
+const char *LATENCY_COLUMNS[] = {"response", "waiting", "turnaround"};
+
+void printCsv(const std::vector<SweepRun> &runs) {
+  printf("policy,cpus,quantum,processes,io_probability,min_cpu_burst,max_cpu_"
+         "burst,seed");
+  for (const char *latency : LATENCY_COLUMNS) {
+    printf(",avg_%s,p50_%s,p95_%s,p99_%s,max_%s", latency, latency, latency,
+           latency, latency);
+  }
+  printf(",total_time,switch_ticks\n");
+  for (auto &run : runs) {
+    const SimulationOptions &o = run.options;
+    printf("%s,%d,%u,%d,%d,%u,%u,%u", o.policy.c_str(), o.numCpus,
+           o.timeQuantum, o.numProcesses, o.ioBurstProbability, o.minCpuBurst,
+           o.maxCpuBurst, *o.seed);
+    for (const LatencySummary *l : {&run.result.response, &run.result.waiting,
+                                    &run.result.turnaround}) {
+      printf(",%.2f,%d,%d,%d,%d", l->average, l->p50, l->p95, l->p99, l->max);
+    }
+    printf(",%u,%u\n", run.result.totalTime, run.result.switchTicks);
+  }
+}
+
+void printJson(const std::vector<SweepRun> &runs) {
+  printf("[\n");
+  for (size_t i = 0; i < runs.size(); i++) {
+    const SimulationOptions &o = runs[i].options;
+    printf("  {\"policy\": \"%s\", \"cpus\": %d, \"quantum\": %u, "
+           "\"processes\": %d, \"io_probability\": %d, \"min_cpu_burst\": %u, "
+           "\"max_cpu_burst\": %u, \"seed\": %u",
+           o.policy.c_str(), o.numCpus, o.timeQuantum, o.numProcesses,
+           o.ioBurstProbability, o.minCpuBurst, o.maxCpuBurst, *o.seed);
+    const LatencySummary *latencies[] = {&runs[i].result.response,
+                                         &runs[i].result.waiting,
+                                         &runs[i].result.turnaround};
+    for (int k = 0; k < 3; k++) {
+      const LatencySummary *l = latencies[k];
+      printf(", \"%s\": {\"avg\": %.2f, \"p50\": %d, \"p95\": %d, "
+             "\"p99\": %d, \"max\": %d}",
+             LATENCY_COLUMNS[k], l->average, l->p50, l->p95, l->p99, l->max);
+    }
+    printf(", \"total_time\": %u, \"switch_ticks\": %u}%s\n",
+           runs[i].result.totalTime, runs[i].result.switchTicks,
+           i + 1 < runs.size() ? "," : "");
+  }
+  printf("]\n");
+}
+
+int main(int argc, char *argv[]) {
+  SweepOptions sweep = parseSweepOptions(argc, argv);
+  std::vector<SweepRun> runs = expandRuns(sweep);
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    std::cerr << ERROR_LOG_PREFIX << "pipe failed" << std::endl;
+    return 1;
+  }
+  fflush(stdout);
+
+  std::unordered_map<pid_t, size_t> workers;
+  size_t nextRun = 0, finished = 0;
+  while (finished < runs.size()) {
+    while (workers.size() < (size_t)sweep.jobs && nextRun < runs.size()) {
+      pid_t pid = startWorker(runs, nextRun, fds[1]);
+      if (pid < 0) {
+        std::cerr << ERROR_LOG_PREFIX << "Fork failed" << std::endl;
+        return 1;
+      }
+      workers[pid] = nextRun++;
+    }
+    // A worker writes its record before it exits, so after a clean exit one
+    // more record is waiting in the pipe (not necessarily its own).
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0 || !workers.count(pid)) {
+      continue;
+    }
+    size_t failedRun = workers[pid];
+    workers.erase(pid);
+    finished++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      std::cerr << ERROR_LOG_PREFIX << "Run " << failedRun << " failed"
+                << std::endl;
+      continue;
+    }
+    char record[sizeof(size_t) + sizeof(SimulationResult)];
+    if (read(fds[0], record, sizeof(record)) != (ssize_t)sizeof(record)) {
+      std::cerr << ERROR_LOG_PREFIX << "Lost a worker result" << std::endl;
+      return 1;
+    }
+    size_t index;
+    memcpy(&index, record, sizeof(size_t));
+    memcpy(&runs[index].result, record + sizeof(size_t), sizeof(SimulationResult));
+    std::cerr << "\r" << finished << "/" << runs.size() << " runs" << std::flush;
+  }
+  std::cerr << std::endl;
+
+  if (sweep.json) {
+    printJson(runs);
+  } else {
+    printCsv(runs);
+  }
+  return 0;
+}
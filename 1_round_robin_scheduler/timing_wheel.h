@@ -0,0 +1,99 @@
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include "utils.h"
+
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS 4
+
+// Hierarchical timing wheel. Level l holds timers whose deadline first
+// differs from the current tick in bit group l, so a timer is touched once
+// per level it cascades through and advancing one tick only looks at the
+// slot that expires. Deadlines beyond the top level wait in an overflow list.
+template <typename T>
+class TimingWheel {
+public:
+    void schedule(unsigned long long deadline, T item) {
+        count++;
+        insert({std::max(deadline, current), item});
+    }
+
+    // Moves the clock to `now` and appends every item due by then.
+    void advance(unsigned long long now, std::vector<T>& due) {
+        if (count == 0) {
+            current = std::max(current, now);
+            return;
+        }
+        collect(current, due);
+        while (current < now) {
+            current++;
+            for (int level = 1; level < WHEEL_LEVELS && (current & ((1ULL << (WHEEL_LEVEL_BITS * level)) - 1)) == 0; level++) {
+                cascade(slots[level][slotIndex(current, level)]);
+                if (level == WHEEL_LEVELS - 1 && slotIndex(current, level) == 0) cascade(overflow);
+            }
+            collect(current, due);
+            if (count == 0) {
+                current = now;
+            }
+        }
+    }
+
+    // Earliest deadline, nothing if no timer is pending. Every timer on a
+    // lower level is due before any timer on a higher one.
+    std::optional<unsigned long long> nextDeadline() const {
+        if (count == 0) return std::nullopt;
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            for (unsigned index = slotIndex(current, level); index < WHEEL_SLOTS; index++) {
+                const std::vector<Timer>& slot = slots[level][index];
+                if (slot.empty()) continue;
+                unsigned long long earliest = slot.front().first;
+                for (const Timer& timer : slot) earliest = std::min(earliest, timer.first);
+                return earliest;
+            }
+        }
+        unsigned long long earliest = overflow.front().first;
+        for (const Timer& timer : overflow) earliest = std::min(earliest, timer.first);
+        return earliest;
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+
+private:
+    typedef std::pair<unsigned long long, T> Timer;
+
+    unsigned long long current = 0;
+    size_t count = 0;
+    std::vector<Timer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    std::vector<Timer> overflow;
+
+    static unsigned slotIndex(unsigned long long tick, int level) {
+        return (tick >> (WHEEL_LEVEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    }
+
+    void insert(const Timer& timer) {
+        unsigned long long differing = timer.first ^ current;
+        int level = differing ? (63 - __builtin_clzll(differing)) / WHEEL_LEVEL_BITS : 0;
+        if (level >= WHEEL_LEVELS) {
+            overflow.push_back(timer);
+        } else {
+            slots[level][slotIndex(timer.first, level)].push_back(timer);
+        }
+    }
+
+    void cascade(std::vector<Timer>& slot) {
+        std::vector<Timer> timers;
+        timers.swap(slot);
+        for (const Timer& timer : timers) insert(timer);
+    }
+
+    void collect(unsigned long long tick, std::vector<T>& due) {
+        std::vector<Timer>& slot = slots[0][slotIndex(tick, 0)];
+        for (const Timer& timer : slot) due.push_back(timer.second);
+        count -= slot.size();
+        slot.clear();
+    }
+};
+
+#endif // TIMING_WHEEL_H
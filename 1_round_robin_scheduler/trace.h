@@ -0,0 +1,105 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+#define TRACE_MAGIC "SCHT"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_EVENTS 4096
+
+enum TraceEventType {
+    ARRIVE = 0,
+    DISPATCH = 1,
+    PREEMPT = 2,
+    IO_START = 3,
+    IO_END = 4,
+    EXIT = 5
+};
+
+// Written once at the start of a trace file, followed by TraceEvents until
+// the end of the file. Both are stored in host byte order.
+struct TraceHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t numCpus;
+    uint32_t timeQuantum;
+    uint32_t numProcesses;
+    char policy[8];
+};
+
+// A state change of one process at the tick the kernel handled it. The
+// bursts are the process' remaining CPU and IO burst right after the event.
+struct TraceEvent {
+    uint32_t tick;
+    int32_t pid;
+    uint8_t type;
+    uint8_t cpu;
+    // DISPATCH: ticks the CPU spends switching before the process runs.
+    uint16_t switchTicks;
+    int32_t remainingCpuBurst;
+    int32_t remainingIoBurst;
+};
+
+// Collects events in memory and writes them in large blocks.
+class TraceWriter {
+public:
+    ~TraceWriter() { close(); }
+
+    bool open(const std::string& path, const TraceHeader& header) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            std::cerr << ERROR_LOG_PREFIX << "Cannot open trace " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        buffer.reserve(TRACE_BUFFER_EVENTS);
+        fwrite(&header, sizeof(header), 1, file);
+        return true;
+    }
+
+    bool isOpen() const { return file != nullptr; }
+
+    void record(TraceEventType type, unsigned tick, const PartialUserProcess* process, int cpu, unsigned switchTicks = 0) {
+        if (!file) return;
+        buffer.push_back({tick, process->pid, (uint8_t)type, (uint8_t)std::max(cpu, 0), (uint16_t)std::min(switchTicks, 0xffffu), process->remainingCpuBurst, process->remainingIoBurst});
+        if (buffer.size() == TRACE_BUFFER_EVENTS) flush();
+    }
+
+    void flush() {
+        if (!file || buffer.empty()) return;
+        fwrite(buffer.data(), sizeof(TraceEvent), buffer.size(), file);
+        buffer.clear();
+    }
+
+    void close() {
+        if (!file) return;
+        flush();
+        fclose(file);
+        file = nullptr;
+    }
+
+private:
+    FILE* file = nullptr;
+    std::vector<TraceEvent> buffer;
+};
+
+bool readTrace(const std::string& path, TraceHeader& header, std::vector<TraceEvent>& events) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cerr << ERROR_LOG_PREFIX << "Cannot open trace " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, TRACE_MAGIC, 4) == 0 && header.version == TRACE_VERSION;
+    if (!valid) {
+        std::cerr << ERROR_LOG_PREFIX << path << " is not a version " << TRACE_VERSION << " trace" << std::endl;
+        fclose(file);
+        return false;
+    }
+    TraceEvent event;
+    while (fread(&event, sizeof(event), 1, file) == 1) {
+        events.push_back(event);
+    }
+    fclose(file);
+    return true;
+}
+
+#endif // TRACE_H
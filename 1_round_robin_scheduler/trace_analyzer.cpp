@@ -0,0 +1,280 @@
+#include "trace.h"
+#include "utils.h"
+
+// Reads a trace written by `rr_core --trace <file>` and rebuilds what the
+// kernel used to print on every tick, only for the parts asked for:
+//   --events          every event in order
+//   --table <tick>    running, ready and IO tables at the end of a tick
+//   --gantt           one row per process, one column per tick (or --width)
+//   --stats           per-process table, latency percentiles, CPU usage
+// Without any of them --stats and --gantt are printed.
+
+enum TraceState { STATE_READY, STATE_RUNNING, STATE_IO, STATE_DONE };
+
+struct ProcessHistory {
+  int pid;
+  int arrival = -1;
+  int firstRun = -1;
+  int completion = -1;
+  unsigned waiting = 0;
+  unsigned ioWait = 0;
+  unsigned switches = 0;
+  // Events of this process, in trace order.
+  std::vector<TraceEvent> events;
+};
+
+const char *EVENT_NAMES[] = {"ARRIVE", "DISPATCH", "PREEMPT",
+                             "IO_START", "IO_END", "EXIT"};
+
+TraceState stateAfter(uint8_t type) {
+  switch (type) {
+  case TraceEventType::DISPATCH:
+    return STATE_RUNNING;
+  case TraceEventType::IO_START:
+    return STATE_IO;
+  case TraceEventType::EXIT:
+    return STATE_DONE;
+  default:
+    return STATE_READY;
+  }
+}
+
+std::vector<ProcessHistory> buildHistories(const std::vector<TraceEvent> &events) {
+  std::vector<ProcessHistory> histories;
+  std::unordered_map<int, size_t> indexOf;
+  for (const TraceEvent &event : events) {
+    if (!indexOf.count(event.pid)) {
+      indexOf[event.pid] = histories.size();
+      histories.push_back(ProcessHistory());
+      histories.back().pid = event.pid;
+    }
+    ProcessHistory &history = histories[indexOf[event.pid]];
+    const TraceEvent *previous =
+        history.events.empty() ? nullptr : &history.events.back();
+    switch (event.type) {
+    case TraceEventType::ARRIVE:
+      history.arrival = event.tick;
+      break;
+    case TraceEventType::DISPATCH:
+      if (history.firstRun < 0) history.firstRun = event.tick;
+      if (previous) history.waiting += event.tick - previous->tick;
+      history.switches++;
+      break;
+    case TraceEventType::IO_END:
+      if (previous) history.ioWait += event.tick - previous->tick;
+      break;
+    case TraceEventType::EXIT:
+      history.completion = event.tick;
+      break;
+    }
+    history.events.push_back(event);
+  }
+  return histories;
+}
+
+void printEvents(const std::vector<TraceEvent> &events) {
+  printf("%-8s | %-8s | %-8s | %-4s | %-10s | %-10s\n", "Tick", "Event", "PID",
+         "CPU", "CPU Burst", "IO Burst");
+  for (const TraceEvent &event : events) {
+    printf("%-8u | %-8s | %-8d | %-4u | %-10d | %-10d\n", event.tick,
+           event.type <= TraceEventType::EXIT ? EVENT_NAMES[event.type] : "?",
+           event.pid, event.cpu, event.remainingCpuBurst,
+           event.remainingIoBurst);
+  }
+}
+
+// State of every process once all handlers of `tick` have run. Bursts keep
+// counting down between events the same way the kernel does.
+void printTable(const TraceHeader &header,
+                const std::vector<ProcessHistory> &histories, unsigned tick) {
+  std::vector<std::vector<PartialUserProcess>> running(header.numCpus), ready(header.numCpus);
+  std::vector<PartialUserProcess> io;
+  for (const ProcessHistory &history : histories) {
+    const TraceEvent *last = nullptr;
+    for (const TraceEvent &event : history.events) {
+      if (event.tick > tick) break;
+      last = &event;
+    }
+    if (!last) continue;
+    PartialUserProcess process{last->pid, last->remainingCpuBurst,
+                               last->remainingIoBurst};
+    unsigned cpu = std::min<unsigned>(last->cpu, header.numCpus - 1);
+    switch (stateAfter(last->type)) {
+    case STATE_RUNNING:
+      process.remainingCpuBurst -= std::max(0, (int)(tick - last->tick - last->switchTicks));
+      running[cpu].push_back(process);
+      break;
+    case STATE_IO:
+      process.remainingIoBurst = std::max(0, process.remainingIoBurst - (int)(tick - last->tick + 1));
+      io.push_back(process);
+      break;
+    case STATE_READY:
+      ready[cpu].push_back(process);
+      break;
+    case STATE_DONE:
+      break;
+    }
+  }
+
+  auto printGroup = [](const std::string &title,
+                       std::vector<PartialUserProcess> &processes) {
+    std::cout << title;
+    if (processes.empty()) {
+      std::cout << " : Empty" << std::endl;
+      return;
+    }
+    printTableHeader(std::cout);
+    for (auto &process : processes) printProcess(&process, std::cout);
+    printTableFooter(std::cout);
+  };
+  std::cout << "Time Tick T :" << tick << std::endl;
+  for (unsigned cpu = 0; cpu < header.numCpus; cpu++) {
+    std::string label = header.numCpus > 1 ? " CPU " + std::to_string(cpu) : "";
+    printGroup("[Running Processes Info]" + label, running[cpu]);
+    printGroup("[Ready Queue Info]" + label, ready[cpu]);
+  }
+  printGroup("[IO Queue Info]", io);
+}
+
+// '#' (or the CPU number on SMP traces) while running, '*' while the CPU
+// switches to the process, '.' while ready, '~' during IO. A column covers
+// `scale` ticks and shows the state at its first tick.
+void printGantt(const TraceHeader &header,
+                const std::vector<ProcessHistory> &histories, unsigned endTick,
+                unsigned width) {
+  unsigned scale = width ? std::max(1u, (endTick + width) / width) : 1;
+  unsigned columns = endTick / scale + 1;
+  printf("%-8s | 0 .. %u, %u tick(s) per column\n", "PID", endTick, scale);
+  for (const ProcessHistory &history : histories) {
+    std::string row(columns, ' ');
+    for (size_t i = 0; i < history.events.size(); i++) {
+      const TraceEvent &event = history.events[i];
+      unsigned until = i + 1 < history.events.size() ? history.events[i + 1].tick : endTick + 1;
+      char mark;
+      switch (stateAfter(event.type)) {
+      case STATE_RUNNING:
+        mark = header.numCpus > 1 && event.cpu < 10 ? '0' + event.cpu : '#';
+        break;
+      case STATE_IO:
+        mark = '~';
+        break;
+      case STATE_READY:
+        mark = '.';
+        break;
+      default:
+        continue;
+      }
+      for (unsigned column = (event.tick + scale - 1) / scale; column * scale < until && column < columns; column++) {
+        bool switching = column * scale > event.tick && column * scale <= event.tick + event.switchTicks;
+        row[column] = switching ? '*' : mark;
+      }
+    }
+    printf("%-8d | %s\n", history.pid, row.c_str());
+  }
+}
+
+void printLatency(const char *name, const LatencySummary &latency) {
+  printf("\t%-10s | %-9.2f | %-9d | %-9d | %-9d | %-9d\n", name,
+         latency.average, latency.p50, latency.p95, latency.p99, latency.max);
+}
+
+void printStats(const TraceHeader &header,
+                const std::vector<ProcessHistory> &histories,
+                unsigned totalTicks) {
+  std::vector<int> response, waiting, turnaround;
+  std::vector<unsigned> busyTicks(header.numCpus), migrations(header.numCpus),
+      switchTicks(header.numCpus);
+  printf("\t%-8s | %-8s | %-9s | %-10s | %-8s | %-8s | %-8s\n", "PID",
+         "Arrival", "First Run", "Completion", "Wait", "IO Wait", "Switches");
+  for (const ProcessHistory &history : histories) {
+    printf("\t%-8d | %-8d | %-9d | %-10d | %-8u | %-8u | %-8u\n", history.pid,
+           history.arrival, history.firstRun, history.completion,
+           history.waiting, history.ioWait, history.switches);
+    response.push_back(history.firstRun - history.arrival);
+    waiting.push_back(history.waiting);
+    turnaround.push_back(history.completion - history.arrival);
+
+    // The dispatched process starts executing on the tick after the switch.
+    int lastCpu = -1;
+    for (size_t i = 0; i + 1 < history.events.size(); i++) {
+      const TraceEvent &event = history.events[i];
+      if (event.type != TraceEventType::DISPATCH || event.cpu >= header.numCpus) continue;
+      unsigned onCpu = history.events[i + 1].tick - event.tick - 1;
+      switchTicks[event.cpu] += std::min<unsigned>(onCpu, event.switchTicks);
+      busyTicks[event.cpu] += onCpu - std::min<unsigned>(onCpu, event.switchTicks);
+      if (lastCpu >= 0 && lastCpu != event.cpu) migrations[event.cpu]++;
+      lastCpu = event.cpu;
+    }
+  }
+
+  std::cout << "--------------------STAT--------------------" << std::endl;
+  printf("\t%-20s | %-10.8s\n", "Scheduling Policy", header.policy);
+  printf("\t%-20s | %-10u\n", "Time Quantum", header.timeQuantum);
+  printf("\t%-20s | %-10u\n", "Total Execution Time ", totalTicks);
+  for (unsigned cpu = 0; cpu < header.numCpus; cpu++) {
+    std::string label = "CPU " + std::to_string(cpu);
+    printf("\t%-20s | %-10.2f\n", (label + " Utilization %").c_str(),
+           totalTicks ? busyTicks[cpu] * 100.0 / totalTicks : 0.0);
+    printf("\t%-20s | %-10u\n", (label + " Migrations").c_str(), migrations[cpu]);
+    printf("\t%-20s | %-10u\n", (label + " Switch Ticks").c_str(), switchTicks[cpu]);
+  }
+  printf("\n\t%-10s | %-9s | %-9s | %-9s | %-9s | %-9s\n", "Latency",
+         "Average", "p50", "p95", "p99", "Max");
+  printLatency("Response", summarizeLatencies(response));
+  printLatency("Waiting", summarizeLatencies(waiting));
+  printLatency("Turnaround", summarizeLatencies(turnaround));
+  std::cout << "--------------------------------------------" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  std::string path;
+  bool events = false, gantt = false, stats = false;
+  std::vector<unsigned> tables;
+  unsigned width = 0;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--events") {
+      events = true;
+    } else if (arg == "--gantt") {
+      gantt = true;
+    } else if (arg == "--stats") {
+      stats = true;
+    } else if (arg == "--table" && i + 1 < argc) {
+      tables.push_back(strtoul(argv[++i], nullptr, 0));
+    } else if (arg == "--width" && i + 1 < argc) {
+      width = strtoul(argv[++i], nullptr, 0);
+    } else if (path.empty() && arg[0] != '-') {
+      path = arg;
+    } else {
+      std::cerr << ERROR_LOG_PREFIX << "Unknown option " << arg << ", ignored."
+                << std::endl;
+    }
+  }
+  if (path.empty()) {
+    std::cerr << "usage: " << argv[0]
+              << " <trace> [--events] [--table <tick>]... [--gantt [--width "
+                 "<columns>]] [--stats]"
+              << std::endl;
+    return 1;
+  }
+  if (!events && !gantt && !stats && tables.empty()) {
+    gantt = stats = true;
+  }
+
+  TraceHeader header;
+  std::vector<TraceEvent> trace;
+  if (!readTrace(path, header, trace)) {
+    return 1;
+  }
+  header.numCpus = std::max<uint16_t>(header.numCpus, 1);
+  std::vector<ProcessHistory> histories = buildHistories(trace);
+  unsigned endTick = 0;
+  for (const TraceEvent &event : trace) endTick = std::max(endTick, event.tick);
+
+  if (events) printEvents(trace);
+  for (unsigned tick : tables) printTable(header, histories, tick);
+  if (gantt) printGantt(header, histories, endTick, width);
+  // The kernel also counts the tick in which the last process exits.
+  if (stats) printStats(header, histories, endTick + 1);
+  return 0;
+}
@@ -0,0 +1,475 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "utils.h"
+#include <cassert>
+
+#define PROTOCOL_VERSION 1
+// A batch carries each command with its param, all in one message. A child
+// gets at most three commands per tick (taken off a CPU, put back on one,
+// and its first tick there), so eight leave room to spare.
+#define MAX_BATCH_COMMANDS 8
+#define MAX_COMMAND_PARAMS (2 * MAX_BATCH_COMMANDS)
+
+// Fixed binary layout of every command. Only the header and the used params
+// are put on the wire, and nothing is formatted or parsed as text.
+struct CommandMessage {
+    uint8_t version;
+    uint8_t command;
+    uint8_t paramCount;
+    uint8_t reserved;
+    int32_t sender;
+    int32_t params[MAX_COMMAND_PARAMS];
+};
+
+struct message {
+    long mtype;
+    CommandMessage body;
+};
+
+size_t commandLength(size_t paramCount) {
+    return offsetof(CommandMessage, params) + paramCount * sizeof(int32_t);
+}
+
+bool validateCommand(const CommandMessage& command, size_t length) {
+    if (length < commandLength(0)) {
+        std::cerr << ERROR_LOG_PREFIX << "Truncated message of " << length << " bytes." << std::endl;
+        return false;
+    }
+    if (command.version != PROTOCOL_VERSION) {
+        std::cerr << ERROR_LOG_PREFIX << "Unsupported protocol version " << (int)command.version << "." << std::endl;
+        return false;
+    }
+    if (command.paramCount > MAX_COMMAND_PARAMS || length != commandLength(command.paramCount)) {
+        std::cerr << ERROR_LOG_PREFIX << "Malformed message with " << (int)command.paramCount << " params in " << length << " bytes." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Carries kernel <-> user process messages. Receivers are addressed by pid
+// exactly like the mtype of a SysV message.
+class Transport {
+public:
+    virtual ~Transport() {}
+    virtual bool send(const message& msg, size_t length) = 0;
+    virtual bool receive(long receiver, message& msg, size_t& length, bool wait) = 0;
+    virtual bool isClosed() const { return false; }
+};
+
+class MessageQueueTransport : public Transport {
+public:
+    explicit MessageQueueTransport(int msgid) : msgid(msgid) {}
+
+    bool send(const message& msg, size_t length) override {
+        if (msgsnd(msgid, &msg, length, IPC_NOWAIT) == -1) {
+            std::cerr << ERROR_LOG_PREFIX << "Error sending message. Error code: " << errno << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool receive(long receiver, message& msg, size_t& length, bool wait) override {
+        ssize_t received = msgrcv(msgid, &msg, sizeof(msg.body), receiver, wait ? 0 : IPC_NOWAIT);
+        if (received < 0) {
+            if(errno == EIDRM || errno == EINVAL) closed = true;
+            if(errno != ENOMSG && errno != EINTR) std::cerr << ERROR_LOG_PREFIX << "Error receiving message. Error code: " << errno << std::endl;
+            return false;
+        }
+        length = received;
+        return true;
+    }
+
+    bool isClosed() const override { return closed; }
+
+    void clear() {
+        message msg;
+        while (msgrcv(msgid, &msg, sizeof(msg.body), 0, IPC_NOWAIT) != -1) { }
+
+        if (errno != ENOMSG) {
+            std::cerr << ERROR_LOG_PREFIX << "Error in clearing message queue: " << strerror(errno) << std::endl;
+        }
+    }
+
+private:
+    int msgid;
+    bool closed = false;
+};
+
+// In-process transport. Messages to a receiver with a handler (a user process
+// state machine) are dispatched synchronously; everything else is queued in
+// the receiver's mailbox until it is received.
+class LocalTransport : public Transport {
+public:
+    void attach(long receiver, std::function<void(const message&, size_t)> handler) {
+        handlers[receiver] = handler;
+    }
+
+    void detach(long receiver) {
+        handlers.erase(receiver);
+    }
+
+    bool send(const message& msg, size_t length) override {
+        auto handler = handlers.find(msg.mtype);
+        if (handler != handlers.end()) {
+            std::function<void(const message&, size_t)> deliver = handler->second;
+            deliver(msg, length);
+        } else {
+            mailboxes[msg.mtype].push({msg, length});
+        }
+        return true;
+    }
+
+    bool receive(long receiver, message& msg, size_t& length, bool /*wait*/) override {
+        auto mailbox = mailboxes.find(receiver);
+        if (mailbox == mailboxes.end() || mailbox->second.empty()) {
+            return false; // nothing can arrive while the single thread waits
+        }
+        msg = mailbox->second.front().first;
+        length = mailbox->second.front().second;
+        mailbox->second.pop();
+        return true;
+    }
+
+private:
+    std::unordered_map<long, std::function<void(const message&, size_t)>> handlers;
+    std::unordered_map<long, std::queue<std::pair<message, size_t>>> mailboxes;
+};
+
+// Shared-memory transport for forked children. Every child owns two
+// single-producer/single-consumer rings in one MAP_SHARED segment: one for
+// kernel -> child and one for child -> kernel. A consumer with nothing to
+// read sleeps on a futex that the producer only wakes when someone sleeps,
+// so a message costs no syscall while the receiver is busy.
+#define SHM_RING_CAPACITY 256
+
+struct SharedRing {
+    alignas(64) std::atomic<uint64_t> head; // next entry to read
+    alignas(64) std::atomic<uint64_t> tail; // next entry to write
+    alignas(64) std::atomic<uint32_t> sequence; // futex word, bumped per write
+    std::atomic<uint32_t> sleepers;
+    struct Entry {
+        uint32_t length;
+        message msg;
+    } entries[SHM_RING_CAPACITY];
+};
+
+struct SharedSegmentHeader {
+    std::atomic<uint32_t> closed;
+    // The kernel sleeps on this word for messages from any child.
+    std::atomic<uint32_t> kernelSequence;
+    std::atomic<uint32_t> kernelSleepers;
+};
+
+void futexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, nullptr, nullptr, 0);
+#else
+    if (word->load() == expected) std::this_thread::yield();
+#endif
+}
+
+void futexWakeAll(std::atomic<uint32_t>* word) {
+#ifdef __linux__
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+class SharedMemoryTransport : public Transport {
+public:
+    // Maps the segment; must happen before the children are forked.
+    SharedMemoryTransport(pid_t kernelPid, size_t maxPeers) : kernelPid(kernelPid), maxPeers(maxPeers) {
+        maskWords = (this->maxPeers + 63) / 64;
+        size = sizeof(SharedSegmentHeader) + maskWords * sizeof(std::atomic<uint64_t>) + 2 * this->maxPeers * sizeof(SharedRing);
+        void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapped == MAP_FAILED) {
+            std::cerr << ERROR_LOG_PREFIX << "Cannot map shared transport: " << strerror(errno) << std::endl;
+            this->maxPeers = 0;
+            return;
+        }
+        // Anonymous memory is zeroed, which is a valid empty state for all rings.
+        segment = static_cast<char*>(mapped);
+        header = reinterpret_cast<SharedSegmentHeader*>(segment);
+        readyMask = reinterpret_cast<std::atomic<uint64_t>*>(segment + sizeof(SharedSegmentHeader));
+        rings = reinterpret_cast<SharedRing*>(segment + sizeof(SharedSegmentHeader) + maskWords * sizeof(std::atomic<uint64_t>));
+    }
+
+    ~SharedMemoryTransport() {
+        if (segment) munmap(segment, size);
+    }
+
+    // Slot for the next child, -1 once all are taken. Call before fork().
+    int reserveSlot() {
+        if (!freeSlots.empty()) {
+            int slot = freeSlots.back();
+            freeSlots.pop_back();
+            return slot;
+        }
+        return nextSlot < maxPeers ? (int)nextSlot++ : -1;
+    }
+
+    // In the kernel once `pid` exited: empties its rings and hands its slot
+    // to the next child. False while the kernel has not read all it sent.
+    bool releasePeer(pid_t pid) {
+        auto slot = slots.find(pid);
+        if (slot == slots.end()) return false;
+        SharedRing& up = upRing(slot->second);
+        if (up.head.load() != up.tail.load()) return false;
+        for (SharedRing* ring : {&up, &downRing(slot->second)}) {
+            ring->head.store(0);
+            ring->tail.store(0);
+        }
+        readyMask[slot->second / 64].fetch_and(~(1ULL << (slot->second % 64)));
+        freeSlots.push_back(slot->second);
+        slots.erase(slot);
+        return true;
+    }
+
+    // In the kernel after fork(): messages to `pid` go to its slot.
+    void bindPeer(int slot, pid_t pid) {
+        slots[pid] = slot;
+    }
+
+    // In the child after fork(): this process talks to the kernel through `slot`.
+    void becomePeer(int slot) {
+        localSlot = slot;
+    }
+
+    bool send(const message& msg, size_t length) override {
+        if (!segment) return false;
+        if (localSlot >= 0) {
+            if (msg.mtype != kernelPid) {
+                std::cerr << ERROR_LOG_PREFIX << "Children can only message the kernel." << std::endl;
+                return false;
+            }
+            if (!push(upRing(localSlot), msg, length)) return false;
+            readyMask[localSlot / 64].fetch_or(1ULL << (localSlot % 64));
+            header->kernelSequence.fetch_add(1);
+            if (header->kernelSleepers.load() > 0) futexWakeAll(&header->kernelSequence);
+            return true;
+        }
+        auto slot = slots.find(msg.mtype);
+        if (slot == slots.end()) {
+            std::cerr << ERROR_LOG_PREFIX << "No shared ring for " << msg.mtype << "." << std::endl;
+            return false;
+        }
+        SharedRing& ring = downRing(slot->second);
+        if (!push(ring, msg, length)) return false;
+        ring.sequence.fetch_add(1);
+        if (ring.sleepers.load() > 0) futexWakeAll(&ring.sequence);
+        return true;
+    }
+
+    bool receive(long /*receiver*/, message& msg, size_t& length, bool wait) override {
+        if (!segment) return false;
+        if (localSlot >= 0) {
+            SharedRing& ring = downRing(localSlot);
+            return waitFor([&] { return pop(ring, msg, length); }, ring.sequence, ring.sleepers, wait);
+        }
+        return waitFor([&] { return popAnyChild(msg, length); }, header->kernelSequence, header->kernelSleepers, wait);
+    }
+
+    bool isClosed() const override { return !segment || header->closed.load(); }
+
+    // Wakes every sleeping receiver and makes them see the transport closed.
+    void close() {
+        if (!segment) return;
+        header->closed.store(1);
+        header->kernelSequence.fetch_add(1);
+        futexWakeAll(&header->kernelSequence);
+        for (size_t slot = 0; slot < nextSlot; slot++) {
+            downRing(slot).sequence.fetch_add(1);
+            futexWakeAll(&downRing(slot).sequence);
+        }
+    }
+
+private:
+    pid_t kernelPid;
+    size_t maxPeers;
+    size_t maskWords;
+    size_t size = 0;
+    char* segment = nullptr;
+    SharedSegmentHeader* header = nullptr;
+    std::atomic<uint64_t>* readyMask = nullptr;
+    SharedRing* rings = nullptr;
+    size_t nextSlot = 0;
+    std::vector<int> freeSlots;
+    size_t nextScanWord = 0;
+    int localSlot = -1;
+    std::unordered_map<long, int> slots;
+
+    SharedRing& downRing(int slot) { return rings[2 * slot]; }
+    SharedRing& upRing(int slot) { return rings[2 * slot + 1]; }
+
+    static bool push(SharedRing& ring, const message& msg, size_t length) {
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail - ring.head.load(std::memory_order_acquire) == SHM_RING_CAPACITY) {
+            std::cerr << ERROR_LOG_PREFIX << "Shared ring full, message to " << msg.mtype << " dropped." << std::endl;
+            return false;
+        }
+        SharedRing::Entry& entry = ring.entries[tail % SHM_RING_CAPACITY];
+        entry.length = length;
+        memcpy(&entry.msg, &msg, offsetof(message, body) + length);
+        ring.tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    static bool pop(SharedRing& ring, message& msg, size_t& length) {
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        if (head == ring.tail.load(std::memory_order_acquire)) return false;
+        const SharedRing::Entry& entry = ring.entries[head % SHM_RING_CAPACITY];
+        length = std::min<size_t>(entry.length, sizeof(msg.body));
+        memcpy(&msg, &entry.msg, offsetof(message, body) + length);
+        ring.head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Children flag their up ring in readyMask after writing; the scan starts
+    // where the last one stopped so no child is starved.
+    bool popAnyChild(message& msg, size_t& length) {
+        for (size_t i = 0; i < maskWords; i++) {
+            size_t word = (nextScanWord + i) % maskWords;
+            uint64_t bits = readyMask[word].load();
+            while (bits) {
+                int slot = word * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                SharedRing& ring = upRing(slot);
+                if (pop(ring, msg, length)) {
+                    nextScanWord = word;
+                    return true;
+                }
+                // Clear the flag, then look again in case a write raced with it.
+                readyMask[word].fetch_and(~(1ULL << (slot % 64)));
+                if (ring.tail.load() != ring.head.load()) readyMask[word].fetch_or(1ULL << (slot % 64));
+            }
+        }
+        return false;
+    }
+
+    // The sleeper count and sequence are read around the emptiness check, so
+    // a producer either sees the sleeper or changes the value futexWait expects.
+    template <typename TryReceive>
+    bool waitFor(TryReceive tryReceive, std::atomic<uint32_t>& sequence, std::atomic<uint32_t>& sleepers, bool wait) {
+        if (tryReceive()) return true;
+        if (!wait) return false;
+        sleepers.fetch_add(1);
+        bool received = false;
+        while (!shutdownRequested && !header->closed.load()) {
+            uint32_t expected = sequence.load();
+            if ((received = tryReceive())) break;
+            futexWait(&sequence, expected);
+        }
+        sleepers.fetch_sub(1);
+        return received || tryReceive();
+    }
+};
+
+void sendCommand(Transport& transport, pid_t sender, pid_t receiver, int command, std::initializer_list<int> additionalParams = {}) {
+    message msg;
+    msg.mtype = receiver;
+    msg.body.version = PROTOCOL_VERSION;
+    msg.body.command = command;
+    msg.body.paramCount = 0;
+    msg.body.reserved = 0;
+    msg.body.sender = sender;
+    for (int param : additionalParams) {
+        if (msg.body.paramCount == MAX_COMMAND_PARAMS) {
+            std::cerr << ERROR_LOG_PREFIX << "Too many params for command " << command << ", truncated." << std::endl;
+            break;
+        }
+        msg.body.params[msg.body.paramCount++] = param;
+    }
+    transport.send(msg, commandLength(msg.body.paramCount));
+}
+
+bool decodeCommand(const message& receivedMessage, size_t length, CommandMessage& command) {
+    if (!validateCommand(receivedMessage.body, length)) {
+        return false;
+    }
+    command = receivedMessage.body;
+    return true;
+}
+
+bool receiveCommand(Transport& transport, long myPID, CommandMessage& command, bool wait = false) {
+    message receivedMessage;
+    size_t length = 0;
+    if (!transport.receive(myPID, receivedMessage, length, wait)) {
+        return false;
+    }
+    return decodeCommand(receivedMessage, length, command);
+}
+
+// Collects the commands of one tick and sends every recipient a single
+// message with all of its commands, in the order they were added, so the
+// child applies them as one unit. A recipient addressed once gets the plain
+// command.
+class CommandBatcher {
+public:
+    CommandBatcher(Transport& transport, pid_t sender) : transport(transport), sender(sender) {}
+
+    // Batched commands carry at most one param.
+    void add(pid_t receiver, int command, std::initializer_list<int> params = {}) {
+        auto index = batchIndex.find(receiver);
+        if (index == batchIndex.end()) {
+            index = batchIndex.emplace(receiver, batches.size()).first;
+            batches.push_back({receiver, {}});
+        }
+        std::vector<BatchedCommand>& commands = batches[index->second].commands;
+        // Splitting a batch would break its atomicity; more commands per tick
+        // than MAX_BATCH_COMMANDS are a kernel bug.
+        assert(commands.size() < MAX_BATCH_COMMANDS);
+        commands.push_back({command, params.size() > 0, params.size() > 0 ? *params.begin() : 0});
+    }
+
+    // Sends everything collected so far; returns the number of messages.
+    unsigned flush() {
+        unsigned sent = 0;
+        for (auto& batch : batches) {
+            if (batch.commands.size() == 1) {
+                const BatchedCommand& command = batch.commands[0];
+                if (command.hasParam) {
+                    sendCommand(transport, sender, batch.receiver, command.command, {command.param});
+                } else {
+                    sendCommand(transport, sender, batch.receiver, command.command);
+                }
+                sent++;
+                continue;
+            }
+            message msg;
+            msg.mtype = batch.receiver;
+            msg.body.version = PROTOCOL_VERSION;
+            msg.body.command = ParentCommand::BATCH;
+            msg.body.paramCount = 0;
+            msg.body.reserved = 0;
+            msg.body.sender = sender;
+            for (size_t i = 0; i < batch.commands.size(); i++) {
+                msg.body.params[msg.body.paramCount++] = batch.commands[i].command;
+                msg.body.params[msg.body.paramCount++] = batch.commands[i].param;
+            }
+            transport.send(msg, commandLength(msg.body.paramCount));
+            sent++;
+        }
+        batches.clear();
+        batchIndex.clear();
+        return sent;
+    }
+
+private:
+    struct BatchedCommand {
+        int command;
+        bool hasParam;
+        int param;
+    };
+
+    struct Batch {
+        pid_t receiver;
+        std::vector<BatchedCommand> commands;
+    };
+
+    Transport& transport;
+    pid_t sender;
+    std::vector<Batch> batches;
+    std::unordered_map<pid_t, size_t> batchIndex;
+};
+
+#endif // TRANSPORT_H
@@ -0,0 +1,160 @@
+#include <chrono>
+
+#include "transport.h"
+#include "utils.h"
+
+// Measures the kernel <-> child transports the way the simulator uses them:
+//   latency     one child answers every command with an ACK, the kernel waits
+//               for it before sending the next one (round trip per command)
+//   throughput  every child gets a window of commands per round and ACKs each
+//               of them, the kernel waits for all ACKs before the next round
+// Both run for the SysV message queue and the shared-memory rings.
+
+struct BenchOptions {
+  std::vector<std::string> transports = {"msgqueue", "shm"};
+  int roundTrips = 100000;
+  int children = 8;
+  int window = 16;
+  int rounds = 20000;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+double elapsedMicros(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+}
+
+// Answers every command with an ACK until it is deselected.
+void echoLoop(Transport &transport, pid_t kernelPid) {
+  CommandMessage command;
+  pid_t self = getpid();
+  while (!transport.isClosed()) {
+    if (!receiveCommand(transport, self, command, true)) continue;
+    if (command.command == ParentCommand::DESELECT) break;
+    sendCommand(transport, self, kernelPid, ChildCommand::ACK, {command.params[0]});
+  }
+}
+
+class BenchTransport {
+public:
+  BenchTransport(const std::string &name, int children) {
+    if (name == "shm") {
+      shared = std::make_unique<SharedMemoryTransport>(getpid(), children);
+    } else {
+      msgid = msgget(IPC_PRIVATE, 0600 | IPC_CREAT);
+      queue = std::make_unique<MessageQueueTransport>(msgid);
+    }
+  }
+
+  ~BenchTransport() {
+    if (shared) shared->close();
+    if (msgid >= 0) msgctl(msgid, IPC_RMID, nullptr);
+  }
+
+  Transport &get() {
+    return shared ? static_cast<Transport &>(*shared) : *queue;
+  }
+
+  std::vector<pid_t> fork(int children) {
+    std::vector<pid_t> pids;
+    pid_t kernelPid = getpid();
+    for (int i = 0; i < children; i++) {
+      int slot = shared ? shared->reserveSlot() : 0;
+      pid_t pid = ::fork();
+      if (pid == 0) {
+        if (shared) shared->becomePeer(slot);
+        echoLoop(get(), kernelPid);
+        _exit(0);
+      }
+      if (shared) shared->bindPeer(slot, pid);
+      pids.push_back(pid);
+    }
+    return pids;
+  }
+
+  void join(const std::vector<pid_t> &pids) {
+    for (pid_t pid : pids) sendCommand(get(), getpid(), pid, ParentCommand::DESELECT);
+    for (pid_t pid : pids) waitpid(pid, nullptr, 0);
+  }
+
+private:
+  int msgid = -1;
+  std::unique_ptr<MessageQueueTransport> queue;
+  std::unique_ptr<SharedMemoryTransport> shared;
+};
+
+void benchLatency(const std::string &name, int roundTrips) {
+  BenchTransport bench(name, 1);
+  Transport &transport = bench.get();
+  std::vector<pid_t> pids = bench.fork(1);
+  std::vector<int> nanos;
+  nanos.reserve(roundTrips);
+  CommandMessage ack;
+  for (int i = 0; i < roundTrips; i++) {
+    Clock::time_point start = Clock::now();
+    sendCommand(transport, getpid(), pids[0], ParentCommand::EXECUTE_CPU, {i});
+    while (!receiveCommand(transport, getpid(), ack, true)) {
+    }
+    nanos.push_back(elapsedMicros(start) * 1000);
+  }
+  bench.join(pids);
+  LatencySummary summary = summarizeLatencies(nanos);
+  printf("%-10s | %-10s | %-12.0f | %-10d | %-10d | %-10d\n", name.c_str(),
+         "round trip", summary.average, summary.p50, summary.p99, summary.max);
+}
+
+void benchThroughput(const std::string &name, int children, int window, int rounds) {
+  BenchTransport bench(name, children);
+  Transport &transport = bench.get();
+  std::vector<pid_t> pids = bench.fork(children);
+  CommandMessage ack;
+  Clock::time_point start = Clock::now();
+  for (int round = 0; round < rounds; round++) {
+    for (int i = 0; i < window; i++) {
+      for (pid_t pid : pids) {
+        sendCommand(transport, getpid(), pid, ParentCommand::EXECUTE_CPU, {i});
+      }
+    }
+    for (int acks = 0; acks < window * children;) {
+      if (receiveCommand(transport, getpid(), ack, true)) acks++;
+    }
+  }
+  double seconds = elapsedMicros(start) / 1e6;
+  bench.join(pids);
+  // Every command is answered, so each round moves two messages per command.
+  double messages = 2.0 * rounds * window * children;
+  printf("%-10s | %-10s | %-12.0f | %d children, window %d\n", name.c_str(),
+         "msgs/s", messages / seconds, children, window);
+}
+
+int main(int argc, char *argv[]) {
+  BenchOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--transport" && i + 1 < argc) {
+      options.transports = {argv[++i]};
+    } else if (arg == "--round-trips" && i + 1 < argc) {
+      options.roundTrips = std::max(1l, strtol(argv[++i], nullptr, 0));
+    } else if (arg == "--children" && i + 1 < argc) {
+      options.children = std::max(1l, strtol(argv[++i], nullptr, 0));
+    } else if (arg == "--window" && i + 1 < argc) {
+      // The message queue holds 16 KB by default and the rings SHM_RING_CAPACITY.
+      options.window = std::min(std::max(1l, strtol(argv[++i], nullptr, 0)), 64l);
+    } else if (arg == "--rounds" && i + 1 < argc) {
+      options.rounds = std::max(1l, strtol(argv[++i], nullptr, 0));
+    } else {
+      std::cerr << ERROR_LOG_PREFIX << "Unknown option " << arg << ", ignored."
+                << std::endl;
+    }
+  }
+
+  printf("%-10s | %-10s | %-12s | %-10s | %-10s | %-10s\n", "Transport",
+         "Metric", "Average", "p50 (ns)", "p99 (ns)", "Max (ns)");
+  for (const std::string &name : options.transports) {
+    benchLatency(name, options.roundTrips);
+  }
+  for (const std::string &name : options.transports) {
+    benchThroughput(name, options.children, options.window, options.rounds);
+  }
+  return 0;
+}
@@ -1,21 +1,26 @@
 #ifndef USER_H
 #define USER_H
+#include "transport.h"
 #include "utils.h"
+#include "workload.h"
 
 class IOBurst {
 public:
-  IOBurst(unsigned int maxStartTime)
-      : startTime(randomRange(1, maxStartTime)),
-        executeTime(randomRange(1, 20)), requested(false) {
-    std::cout << CHILD_LOG_PREFIX << "IO Burst Created!" << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t Start Time : " << startTime
-              << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t Execute Time : " << executeTime
-              << std::endl;
+  IOBurst(RandomStream &random, unsigned int maxStartTime)
+      : startTime(random.range(1, maxStartTime)),
+        executeTime(random.range(1, 20)), requested(false) {
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "IO Burst Created!" << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t Start Time : " << startTime
+                     << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t Execute Time : " << executeTime
+                     << std::endl;
   }
+  IOBurst(int startTime, int executeTime)
+      : startTime(startTime), executeTime(executeTime), requested(false) {}
   int startTime;
   int executeTime;
   bool requested;
+  int device = 0;
 };
 
 class PCB {
@@ -28,78 +33,174 @@ public:
 
 class UserProcess {
 public:
-  UserProcess(pid_t pid, int cpuBurst, int msgid)
-      : status(ProcessStatus::READY), pcb(pid, cpuBurst), msgid(msgid) {
-    std::cout << CHILD_LOG_PREFIX << "Child Process Created!" << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t PID : " << pcb.pid << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t CPU Burst : " << pcb.cpuBurst
-              << std::endl;
+  // `streamId` picks the random streams, so a process draws the same
+  // numbers whatever pid it gets.
+  UserProcess(pid_t pid, int cpuBurst, Transport &transport, pid_t kernelPid,
+              const SimulationOptions &options = {}, uint64_t streamId = 0)
+      : status(ProcessStatus::READY), transport(transport),
+        kernelPid(kernelPid), pcb(pid, cpuBurst), ioRandom(RANDOM_IO, streamId),
+        lockstep(options.fastForward),
+        ioBurstProbability(options.ioBurstProbability),
+        timeQuantum(options.timeQuantum),
+        numIoDevices(options.ioDevices.size()) {
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child Process Created!"
+                     << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t PID : " << pcb.pid << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t CPU Burst : " << pcb.cpuBurst
+                     << std::endl;
   }
 
   void logInfo() {
-    std::cout << "pid(" << pcb.pid << ") : "
-              << "[" << this->status << "] " << pcb.cpuBurst << std::endl;
+    LOG(CHILD, DEBUG) << "pid(" << pcb.pid << ") : " << "[" << this->status
+                      << "] " << pcb.cpuBurst << std::endl;
   }
 
   void run() {
-    std::cout << CHILD_LOG_PREFIX << "Child Process " << pcb.pid
-              << " listen to message queue" << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child Process " << pcb.pid
+                     << " listen to message queue" << std::endl;
+    installShutdownHandler();
+    logFlush();
     thread = std::thread(&UserProcess::tickHandler, this);
+    // Route shutdown signals to the listening thread so they interrupt it.
+    sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGTERM);
+    sigaddset(&shutdownSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
     thread.join();
   }
 
+  // In-process backend: the transport hands every message for this process
+  // straight to the state machine, no thread and no polling involved.
+  void onMessage(const message &msg, size_t length) {
+    CommandMessage command;
+    if (decodeCommand(msg, length, command)) {
+      handleMessage(command);
+    }
+  }
+
+  bool isTerminated() const { return status == ProcessStatus::TERMINATED; }
+
+  // Replaces the random IO bursts with the entry's IO bursts, each requested
+  // after the CPU burst before it. The PCB must hold the total CPU burst.
+  void followWorkload(const WorkloadEntry &entry) {
+    scriptedIoBursts.clear();
+    nextScriptedIoBurst = 0;
+    for (size_t i = 1; i + 1 < entry.bursts.size(); i += 2) {
+      scriptedIoBursts.push_back({entry.bursts[i - 1], entry.bursts[i]});
+    }
+    scripted = true;
+  }
+
 private:
   int status;
-  int msgid;
+  Transport &transport;
+  pid_t kernelPid;
   PCB pcb;
+  RandomStream ioRandom;
+  bool lockstep;
+  int ioBurstProbability;
+  int timeQuantum;
+  int numIoDevices;
+  bool scripted = false;
+  // (CPU ticks before the request, IO ticks) still to come.
+  std::vector<std::pair<int, int>> scriptedIoBursts;
+  size_t nextScriptedIoBurst = 0;
 
+  // A batch is applied as a whole: every command in it, in order, and a
+  // single acknowledgement afterwards.
+  void handleMessage(const CommandMessage &newMessage) {
+    if (newMessage.command == ParentCommand::BATCH) {
+      LOG(CHILD, DEBUG) << CHILD_LOG_PREFIX << "Child " << pcb.pid
+                        << " received batch of " << newMessage.paramCount / 2
+                        << " commands" << std::endl;
+      for (int i = 0; i + 1 < newMessage.paramCount; i += 2) {
+        CommandMessage command = newMessage;
+        command.command = newMessage.params[i];
+        command.paramCount = 1;
+        command.params[0] = newMessage.params[i + 1];
+        commandHandler(command);
+      }
+    } else {
+      LOG(CHILD, DEBUG) << CHILD_LOG_PREFIX << "Child " << pcb.pid
+                        << " received command " << (int)newMessage.command
+                        << std::endl;
+      commandHandler(newMessage);
+    }
+    if (lockstep) {
+      sendCommand(transport, pcb.pid, kernelPid, ChildCommand::ACK,
+                  {ticksUntilIoRequest()});
+    }
+  }
+
+  // Blocks until the next command arrives, so an idle child costs no CPU and
+  // reacts as soon as the kernel sends something.
   void tickHandler() {
-    while (status != ProcessStatus::TERMINATED) {
-      std::vector<int> newMessage = receiveCommand(msgid, pcb.pid);
-      if (!newMessage.empty()) {
-        std::cout << CHILD_LOG_PREFIX << "Child " << pcb.pid
-                  << " received command " << newMessage.front() << std::endl;
-        std::vector<int> additionalParams(newMessage.begin() + 1,
-                                          newMessage.end());
-        commandHandler(newMessage.front(), additionalParams);
+    while (status != ProcessStatus::TERMINATED && !shutdownRequested &&
+           !transport.isClosed()) {
+      CommandMessage newMessage;
+      // A paced kernel waits a while before the next command.
+      if (!lockstep) {
+        logFlush();
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK * 80));
-    }
-    std::cout << CHILD_LOG_PREFIX << "Child " << pcb.pid << " Terminated"
-              << std::endl;
-  }
-
-  void commandHandler(int command, std::vector<int> additionalParams = {}) {
-    if (command != -1) {
-      switch (command) {
-      case ParentCommand::SELECT_CPU:
-        onSelectCPU();
-        break;
-      case ParentCommand::EXECUTE_CPU:
-        onExecuteCPU(additionalParams.front());
-        break;
-      case ParentCommand::EXECUTE_IO:
-        onExecuteIO(additionalParams.front());
-        break;
-      case ParentCommand::DESELECT:
-        onDeselect();
-        break;
+      if (receiveCommand(transport, pcb.pid, newMessage, true)) {
+        handleMessage(newMessage);
       }
     }
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child " << pcb.pid << " Terminated"
+                     << std::endl;
+  }
+
+  void commandHandler(const CommandMessage &command) {
+    int time = command.paramCount > 0 ? command.params[0] : TIME_TICK;
+    switch (command.command) {
+    case ParentCommand::SELECT_CPU:
+      onSelectCPU();
+      break;
+    case ParentCommand::EXECUTE_CPU:
+      onExecuteCPU(time);
+      break;
+    case ParentCommand::EXECUTE_IO:
+      onExecuteIO(time);
+      break;
+    case ParentCommand::DESELECT:
+      onDeselect();
+      break;
+    }
+  }
+
+  // Number of CPU ticks until this process sends its IO request, -1 if none
+  // is pending. The fast-forward kernel never jumps past this point.
+  int ticksUntilIoRequest() {
+    if (pcb.ioBurst == std::nullopt || pcb.ioBurst->requested) {
+      return -1;
+    }
+    return std::max(pcb.ioBurst->startTime, 1);
   }
 
   void randomGenerateIoBurst() {
+    if (scripted) {
+      if (pcb.ioBurst == std::nullopt &&
+          nextScriptedIoBurst < scriptedIoBursts.size()) {
+        auto [cpuTicks, ioTicks] = scriptedIoBursts[nextScriptedIoBurst++];
+        pcb.ioBurst = IOBurst(cpuTicks, ioTicks);
+      }
+      return;
+    }
     if (pcb.ioBurst == std::nullopt &&
-        randomProbability(IO_BURST_PROBABILITY)) {
-      pcb.ioBurst = IOBurst(std::min(pcb.cpuBurst, TIME_QUANTUM) - 2);
+        ioRandom.probability(ioBurstProbability)) {
+      pcb.ioBurst = IOBurst(ioRandom, std::max(std::min(pcb.cpuBurst, timeQuantum) - 2, 1));
+      if (numIoDevices > 1) {
+        pcb.ioBurst->device = ioRandom.range(0, numIoDevices - 1);
+      }
     }
   }
 
   void onSelectCPU() {
-    std::cout << CHILD_LOG_PREFIX << "Child[onSelectCPU] ";
+    LOG(CHILD, DEBUG) << CHILD_LOG_PREFIX << "Child[onSelectCPU] ";
     logInfo();
     status = ProcessStatus::RUNNING;
-    if (pcb.cpuBurst > 2) {
+    if (scripted || pcb.cpuBurst > 2) {
       randomGenerateIoBurst();
     }
   }
@@ -119,18 +220,15 @@ private:
     if (pcb.ioBurst) {
       pcb.ioBurst->startTime -= runningTime;
       if (pcb.ioBurst->startTime <= 0 && !pcb.ioBurst->requested) {
-        std::cout << CHILD_LOG_PREFIX
-                  << "Send IO Burst Request, pid: " << pcb.pid << std::endl;
-        sendCommand(msgid, getppid(), ChildCommand::IO_REQUEST,
-                    {pcb.ioBurst->executeTime});
+        LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Send IO Burst Request, pid: "
+                         << pcb.pid << std::endl;
+        sendCommand(transport, pcb.pid, kernelPid, ChildCommand::IO_REQUEST,
+                    {pcb.ioBurst->executeTime, pcb.ioBurst->device});
         pcb.ioBurst->requested = true;
       }
     }
     if (runningTime != time) {
-      sendCommand(msgid, getppid(), ChildCommand::EARLY_CPU_FINISH);
-    }
-    if (pcb.ioBurst == std::nullopt && pcb.cpuBurst <= 0) {
-      status = ProcessStatus::TERMINATED;
+      sendCommand(transport, pcb.pid, kernelPid, ChildCommand::EARLY_CPU_FINISH);
     }
   }
 
@@ -150,20 +248,18 @@ private:
     pcb.ioBurst->executeTime -= runningTime;
 
     if (pcb.ioBurst->executeTime <= 0) {
-      std::cout << "IO Burst Finished, pid: " << pcb.pid << std::endl;
+      LOG(CHILD, INFO) << "IO Burst Finished, pid: " << pcb.pid << std::endl;
       pcb.ioBurst = std::nullopt;
-      if (pcb.cpuBurst <= 0) {
-        status = ProcessStatus::TERMINATED;
-      } else {
-        status = ProcessStatus::READY;
-      }
+      status = ProcessStatus::READY;
     }
 
     if (runningTime != time) {
-      sendCommand(msgid, getppid(), ChildCommand::EARLY_IO_FINISH);
+      sendCommand(transport, pcb.pid, kernelPid, ChildCommand::EARLY_IO_FINISH);
     }
   }
 
+  // The kernel always follows the last CPU or IO tick with a DESELECT, so the
+  // process only terminates there and the final command is still received.
   void onDeselect() {
     if (pcb.cpuBurst <= 0 && pcb.ioBurst == std::nullopt) {
       status = ProcessStatus::TERMINATED;
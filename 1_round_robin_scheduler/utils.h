@@ -2,26 +2,57 @@
 #define UTIL_H
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <functional>
+#include <climits>
 #include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <optional>
 #include <queue>
 #include <random>
+#include <signal.h>
+#include <unordered_map>
 #include <sstream>
 #include <string>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/msg.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <thread>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 #include <vector>
 
+#include "log.h"
+
 #define IO_BURST_PROBABILITY 80
 #define NUM_CHILD_PROCESSES 10
 #define TIME_QUANTUM 10
 #define TIME_TICK 1
+#define MIN_CPU_BURST 5
+#define MAX_CPU_BURST 30
+#define MAX_CPUS 64
+// Children alive at once with the shared-memory transport.
+#define SHM_MAX_PEERS 4096
+// Static priorities run from 0 (highest) to PRIORITY_LEVELS - 1; nice 0 is
+// DEFAULT_PRIORITY, as in Linux.
+#define PRIORITY_LEVELS 140
+#define DEFAULT_PRIORITY 120
+#define MIN_NICE -20
+#define MAX_NICE 19
 #define MESSAGE_QUEUE_NAME  "/message_queue"
 #define CHILD_LOG_PREFIX "|>\tCHILD PROCESS LOG : "
 #define ERROR_LOG_PREFIX "xxx ERROR xxx : "
@@ -30,13 +61,16 @@ enum ParentCommand {
     EXECUTE_CPU = 0,
     EXECUTE_IO = 1,
     SELECT_CPU = 2,
-    DESELECT = 4
+    DESELECT = 4,
+    // Several of the above for one process, as (command, param) pairs.
+    BATCH = 5
 };
 
 enum ChildCommand {
     EARLY_CPU_FINISH = 0,
     IO_REQUEST = 1,
     EARLY_IO_FINISH = 2,
+    ACK = 3
 };
 
 enum ProcessStatus {
@@ -47,104 +81,392 @@ enum ProcessStatus {
     WAITING = 4
 };
 
+struct IoDeviceConfig {
+    std::string name;
+    unsigned queueDepth;
+    double serviceRate;
+};
+
+// Simulated cost of switching a CPU to another process, in ticks: a fixed
+// part plus a cache/TLB warm-up of `warmupPercent` of the ticks the process
+// was off the CPU, at most `maxWarmup`.
+struct SwitchCost {
+    unsigned fixed = 0;
+    unsigned warmupPercent = 0;
+    unsigned maxWarmup = UINT_MAX;
+};
+
+// Splits "<a>[:<b>]..." into non-negative numbers, false if a part is not one.
+bool parseNumbers(const std::string& value, std::vector<unsigned>& parts) {
+    std::stringstream stream(value);
+    std::string part;
+    parts.clear();
+    while (std::getline(stream, part, ':')) {
+        char* end;
+        long number = strtol(part.c_str(), &end, 0);
+        if (part.empty() || *end || number < 0) return false;
+        parts.push_back(number);
+    }
+    return true;
+}
+
+// "<fixed>[:<warm-up %>[:<max warm-up>]]", false if it is not.
+bool parseSwitchCost(const std::string& value, SwitchCost& cost) {
+    std::vector<unsigned> parts;
+    if (!parseNumbers(value, parts) || parts.empty() || parts.size() > 3) return false;
+    cost = SwitchCost();
+    cost.fixed = parts[0];
+    if (parts.size() > 1) cost.warmupPercent = parts[1];
+    if (parts.size() > 2) cost.maxWarmup = parts[2];
+    return true;
+}
+
+// A periodic real-time task run by the kernel itself: a job of `wcet` ticks
+// is released every `period` ticks and due `deadline` ticks after release.
+// A sporadic task waits up to `jitter` ticks more between releases.
+struct RealTimeTaskConfig {
+    unsigned period;
+    unsigned wcet;
+    unsigned deadline;
+    unsigned jitter = 0;
+};
+
+// "<period>:<wcet>[:<deadline>[:<jitter>]]", the deadline defaulting to the
+// period; false if it is not, or the job cannot fit before its deadline.
+bool parseRealTimeTask(const std::string& value, RealTimeTaskConfig& task) {
+    std::vector<unsigned> parts;
+    if (!parseNumbers(value, parts) || parts.size() < 2 || parts.size() > 4) return false;
+    task = {parts[0], parts[1], parts.size() > 2 ? parts[2] : parts[0], parts.size() > 3 ? parts[3] : 0};
+    return task.period > 0 && task.wcet > 0 && task.wcet <= task.deadline;
+}
+
+struct SimulationOptions {
+    // Run the kernel on a virtual clock: children acknowledge every command
+    // and the kernel jumps over ticks where nothing can change.
+    bool fastForward = false;
+    // Run every user process as a state machine inside the kernel process
+    // instead of forking one OS process per child.
+    bool inProcess = false;
+    // Kernel <-> child transport when forking: "msgqueue" or "shm".
+    std::string transport = "msgqueue";
+    int numProcesses = NUM_CHILD_PROCESSES;
+    std::string policy = "rr";
+    int numCpus = 1;
+    // Pin the process at a given creation index to a CPU bit mask.
+    std::vector<std::pair<int, unsigned long long>> affinities;
+    std::vector<std::pair<int, int>> nices;
+    unsigned timeQuantum = TIME_QUANTUM;
+    int ioBurstProbability = IO_BURST_PROBABILITY;
+    unsigned minCpuBurst = MIN_CPU_BURST;
+    unsigned maxCpuBurst = MAX_CPU_BURST;
+    std::optional<unsigned> seed;
+    // Binary event trace instead of the per-tick table dumps.
+    std::string tracePath;
+    // Processes, arrivals and bursts from a file instead of random ones.
+    std::string workloadPath;
+    // Without --device there is one disk serving every request at once.
+    std::vector<IoDeviceConfig> ioDevices = {{"disk", 0, 1.0}};
+    // Messages the kernel handles per tick, 0 for all that are pending.
+    unsigned messageBudget = 0;
+    // Highest level logged per subsystem, see log.h.
+    LogLevels logLevels = logThresholds;
+    SwitchCost switchCost;
+    std::vector<RealTimeTaskConfig> realTimeTasks;
+    // Without the admission test a task that fits no CPU overloads the
+    // least loaded one.
+    bool realTimeAdmission = true;
+};
+
+// Parses "<a>:<b>", false if the separator is missing.
+bool parsePair(const std::string& value, long long& first, long long& second) {
+    size_t colon = value.find(':');
+    if (colon == std::string::npos) return false;
+    first = strtoll(value.substr(0, colon).c_str(), nullptr, 0);
+    second = strtoll(value.c_str() + colon + 1, nullptr, 0);
+    return true;
+}
+
+SimulationOptions parseSimulationOptions(int argc, char* argv[]) {
+    SimulationOptions options;
+    bool customDevices = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--fast-forward") {
+            options.fastForward = true;
+        } else if (arg == "--in-process") {
+            options.inProcess = true;
+        } else if (arg == "--transport" && i + 1 < argc) {
+            options.transport = argv[++i];
+            if (options.transport != "msgqueue" && options.transport != "shm") {
+                std::cerr << ERROR_LOG_PREFIX << "Unknown transport " << options.transport << ", using msgqueue." << std::endl;
+                options.transport = "msgqueue";
+            }
+        } else if (arg == "--policy" && i + 1 < argc) {
+            options.policy = argv[++i];
+        } else if (arg == "--processes" && i + 1 < argc) {
+            options.numProcesses = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--cpus" && i + 1 < argc) {
+            options.numCpus = std::min(MAX_CPUS, std::max(1, atoi(argv[++i])));
+        } else if (arg == "--affinity" && i + 1 < argc) {
+            long long index, mask;
+            if (!parsePair(argv[++i], index, mask)) {
+                std::cerr << ERROR_LOG_PREFIX << "Affinity " << argv[i] << " is not <index>:<mask>, ignored." << std::endl;
+                continue;
+            }
+            options.affinities.push_back({(int)index, (unsigned long long)mask});
+        } else if (arg == "--nice" && i + 1 < argc) {
+            long long index, nice;
+            if (!parsePair(argv[++i], index, nice) || nice < MIN_NICE || nice > MAX_NICE) {
+                std::cerr << ERROR_LOG_PREFIX << "Nice " << argv[i] << " is not <index>:<" << MIN_NICE << ".." << MAX_NICE << ">, ignored." << std::endl;
+                continue;
+            }
+            options.nices.push_back({(int)index, (int)nice});
+        } else if (arg == "--quantum" && i + 1 < argc) {
+            options.timeQuantum = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--io-probability" && i + 1 < argc) {
+            options.ioBurstProbability = std::clamp(atoi(argv[++i]), 0, 100);
+        } else if (arg == "--cpu-burst" && i + 1 < argc) {
+            long long minBurst, maxBurst;
+            if (!parsePair(argv[++i], minBurst, maxBurst) || minBurst < 1 || minBurst > maxBurst) {
+                std::cerr << ERROR_LOG_PREFIX << "CPU burst " << argv[i] << " is not <min>:<max>, ignored." << std::endl;
+                continue;
+            }
+            options.minCpuBurst = minBurst;
+            options.maxCpuBurst = maxBurst;
+        } else if (arg == "--device" && i + 1 < argc) {
+            std::string value = argv[++i];
+            size_t first = value.find(':'), second = value.find(':', first + 1);
+            double rate = second == std::string::npos ? 0 : atof(value.c_str() + second + 1);
+            if (second == std::string::npos || rate <= 0) {
+                std::cerr << ERROR_LOG_PREFIX << "Device " << value << " is not <name>:<queue depth>:<service rate>, ignored." << std::endl;
+                continue;
+            }
+            if (!customDevices) options.ioDevices.clear();
+            customDevices = true;
+            options.ioDevices.push_back({value.substr(0, first), (unsigned)atoi(value.c_str() + first + 1), rate});
+        } else if (arg == "--workload" && i + 1 < argc) {
+            options.workloadPath = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            options.tracePath = argv[++i];
+        } else if (arg == "--message-budget" && i + 1 < argc) {
+            options.messageBudget = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--switch-cost" && i + 1 < argc) {
+            if (!parseSwitchCost(argv[++i], options.switchCost)) {
+                std::cerr << ERROR_LOG_PREFIX << "Switch cost " << argv[i] << " is not <fixed>[:<warm-up %>[:<max warm-up>]], ignored." << std::endl;
+            }
+        } else if (arg == "--rt-task" && i + 1 < argc) {
+            RealTimeTaskConfig task;
+            if (!parseRealTimeTask(argv[++i], task)) {
+                std::cerr << ERROR_LOG_PREFIX << "Real-time task " << argv[i] << " is not <period>:<wcet>[:<deadline>[:<jitter>]] with wcet <= deadline, ignored." << std::endl;
+                continue;
+            }
+            options.realTimeTasks.push_back(task);
+        } else if (arg == "--rt-no-admission") {
+            options.realTimeAdmission = false;
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            LogLevel level = LogLevel::OFF;
+            if (!parseLogLevel(argv[++i], level)) {
+                std::cerr << ERROR_LOG_PREFIX << "Log level " << argv[i] << " is not off, error, warn, info or debug, ignored." << std::endl;
+                continue;
+            }
+            options.logLevels.fill(level);
+        } else if (arg == "--log" && i + 1 < argc) {
+            std::string value = argv[++i];
+            size_t colon = value.find(':');
+            LogSubsystem subsystem;
+            LogLevel level = LogLevel::OFF;
+            if (colon == std::string::npos || !parseLogSubsystem(value.substr(0, colon), subsystem) || !parseLogLevel(value.substr(colon + 1), level)) {
+                std::cerr << ERROR_LOG_PREFIX << "Log filter " << value << " is not <sched|io|child>:<level>, ignored." << std::endl;
+                continue;
+            }
+            options.logLevels[(int)subsystem] = level;
+        } else {
+            std::cerr << ERROR_LOG_PREFIX << "Unknown option " << arg << ", ignored." << std::endl;
+        }
+    }
+    // All of them are forked before the first tick, each with its own rings.
+    if (!options.inProcess && options.transport == "shm" && options.workloadPath.empty() && options.numProcesses > SHM_MAX_PEERS) {
+        std::cerr << ERROR_LOG_PREFIX << "--transport shm runs at most " << SHM_MAX_PEERS << " processes, not " << options.numProcesses << "." << std::endl;
+        exit(1);
+    }
+    return options;
+}
+
+// Set when a child is asked to stop while it blocks on its next command.
+volatile sig_atomic_t shutdownRequested = 0;
+
+void onShutdownSignal(int) { shutdownRequested = 1; }
+
+// No SA_RESTART: a receive blocked in msgrcv returns with EINTR instead.
+void installShutdownHandler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onShutdownSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGINT, &action, nullptr);
+}
+
 struct PartialUserProcess {
     int pid;
     int remainingCpuBurst;
     int remainingIoBurst;
+    // Bookkeeping owned by the scheduling policy.
+    unsigned long long vruntime = 0;
+    int queueLevel = 0;
+    unsigned queueEpoch = 0;
+    // Bit i set: the process may run on CPU i.
+    unsigned long long affinity = ~0ULL;
+    int lastCpu = -1;
+    // From the workload file; the priority policy runs the process at
+    // priority + nice.
+    int priority = DEFAULT_PRIORITY;
+    int nice = 0;
+    // Device of the current or last IO request.
+    int ioDevice = 0;
+    // Per-process accounting in ticks. The arrival tick is set on admission;
+    // response and turnaround are the first run and completion ticks minus
+    // it, and both stay -1 until they happen. Waiting and IO time are added
+    // up lazily from the tick the process entered the state, so waiting
+    // counts only ticks since arrival too.
+    int arrivalTick = 0;
+    int firstRunTick = -1;
+    int completionTick = -1;
+    unsigned readySince = 0;
+    unsigned blockedSince = 0;
+    // Tick the process last left a CPU (or arrived), for the warm-up cost.
+    unsigned offCpuSince = 0;
+    unsigned waitingTicks = 0;
+    unsigned ioWaitTicks = 0;
+    unsigned contextSwitches = 0;
 };
 
-unsigned int randomRange(unsigned int min, unsigned int max) {
-    if (min > max) {
-        std::cerr << ERROR_LOG_PREFIX << "min > max, return 0;" << std::endl
-                  << ERROR_LOG_PREFIX << "Make sure min <= max when you call this function after." << std::endl;
-        return 0;
-    }
+bool allowedOn(const PartialUserProcess* process, int cpu) {
+    return process->affinity & (1ULL << cpu);
+}
 
-    static std::random_device rd;
-    static std::mt19937 rng(rd());
-    std::uniform_int_distribution<unsigned int> uni(min, max);
+// Subsystems drawing random numbers. Each process has its own stream per
+// subsystem, keyed by its arrival index rather than its pid.
+enum RandomSubsystem {
+    RANDOM_BURSTS = 1,
+    RANDOM_IO = 2,
+    // Release jitter of sporadic real-time tasks, keyed by task index.
+    RANDOM_REALTIME = 3
+};
 
-    return uni(rng);
+// Master seed of every stream, from std::random_device unless --seed is given.
+uint64_t& masterSeed() {
+    static uint64_t seed = std::random_device{}();
+    return seed;
 }
 
-bool randomProbability(int probability) {
-    unsigned int randomNum = randomRange(0,100);
+void seedRandom(uint64_t seed) {
+    masterSeed() = seed;
+}
 
-    return randomNum < probability;
+uint64_t splitMix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-struct message {
-    long mtype; 
-    char mtext[100]; 
-};
+// Counter-based generator: the n-th number of a stream is a hash of the
+// master seed, the stream key and n. Streams share no state, so what one
+// process draws never depends on when other processes drew, in which process
+// or on which worker the simulation runs.
+class RandomStream {
+public:
+    RandomStream(RandomSubsystem subsystem, uint64_t id) : key(splitMix64(((uint64_t)subsystem << 56) ^ id)) {}
 
-void sendCommand(int msgid, pid_t receiver, int command, const std::vector<int>& additionalParams = {}) {
-    message msg;
-    memset(msg.mtext, 0, sizeof(msg.mtext)); 
-    msg.mtype = receiver;
-    std::ostringstream oss;
-    oss << command; 
-    for (int param : additionalParams) {
-        oss << " " << param; 
+    uint64_t next() {
+        return splitMix64(masterSeed() ^ splitMix64(key + counter++));
     }
-    strncpy(msg.mtext, oss.str().c_str(), sizeof(msg.mtext) - 1);
-    msg.mtext[sizeof(msg.mtext) - 1] = '\0';
 
-    size_t messageLength = strlen(msg.mtext);
-    if (msgsnd(msgid, &msg, messageLength, IPC_NOWAIT) == -1) {
-        std::cerr << ERROR_LOG_PREFIX << "Error sending message. Error code: " << errno << std::endl;
+    unsigned int range(unsigned int min, unsigned int max) {
+        if (min > max) {
+            std::cerr << ERROR_LOG_PREFIX << "min > max, return 0;" << std::endl
+                      << ERROR_LOG_PREFIX << "Make sure min <= max when you call this function after." << std::endl;
+            return 0;
+        }
+        uint64_t span = (uint64_t)max - min + 1;
+        return min + (unsigned int)(((unsigned __int128)next() * span) >> 64);
     }
-}
 
-std::vector<int> receiveCommand(int msgid, long myPID) {
-    message receivedMessage;
-    if (msgrcv(msgid, &receivedMessage, sizeof(receivedMessage.mtext), myPID, IPC_NOWAIT) < 0) {
-        if(errno != ENOMSG) std::cerr << ERROR_LOG_PREFIX << "Error receiving message. Error code: " << errno << std::endl;
-        return {};
+    // True with the given percentage.
+    bool probability(int percent) {
+        return (int)range(0, 99) < percent;
     }
 
-    std::istringstream iss(receivedMessage.mtext);
-    int command;
-    if (!(iss >> command)) {
-        std::cerr << ERROR_LOG_PREFIX << "Error parsing message." << std::endl;
-        return {};
-    }
+private:
+    uint64_t key;
+    uint64_t counter = 0;
+};
 
-    std::vector<int> allParams = {command};
-    int param;
-    while (iss >> param) {
-        allParams.push_back(param);
-    }
-    return allParams;
-}
+// Distribution of one per-process latency, in ticks. Percentiles use the
+// nearest rank.
+struct LatencySummary {
+    double average;
+    int p50;
+    int p95;
+    int p99;
+    int max;
+};
 
-void clearMessageQueue(int msgid) {
-    message msg;
-    while (msgrcv(msgid, &msg, sizeof(msg.mtext), 0, IPC_NOWAIT) != -1) { }
+LatencySummary summarizeLatencies(std::vector<int> samples) {
+    if(samples.empty()) return {0, 0, 0, 0, 0};
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](int p) {
+        size_t rank = (samples.size() * p + 99) / 100;
+        return samples[std::max<size_t>(rank, 1) - 1];
+    };
+    double total = 0;
+    for(int sample : samples) total += sample;
+    return {total / samples.size(), percentile(50), percentile(95), percentile(99), samples.back()};
+}
 
-    if (errno != ENOMSG) {
-        std::cerr << ERROR_LOG_PREFIX << "Error in clearing message queue: " << strerror(errno) << std::endl;
-    }
+// Tables shared by the kernel log and the trace analyzer.
+void printTableHeader(std::ostream& out) {
+    char line[64];
+    snprintf(line, sizeof(line), "\n%-10s | %-10s | %-10s\n", "PID", "CPU Burst", "IO Burst");
+    out << line << "----------------------------------------\n";
 }
 
-void printTableHeader() {
-    printf("\n%-10s | %-10s | %-10s\n", "PID", "CPU Burst", "IO Burst");
-    printf("----------------------------------------\n");
+// "%-10d | %-10d | %-10d", formatted by hand: the per-tick tables print a row
+// per queued process, and printf dominated the logging cost.
+void printProcess(PartialUserProcess* process, std::ostream& out) {
+    char line[64];
+    char* end = line;
+    for (int value : {process->pid, process->remainingCpuBurst, process->remainingIoBurst}) {
+        if (end != line) {
+            memcpy(end, " | ", 3);
+            end += 3;
+        }
+        char* start = end;
+        end = std::to_chars(end, line + sizeof(line), value).ptr;
+        while (end - start < 10) *end++ = ' ';
+    }
+    *end++ = '\n';
+    out.write(line, end - line);
 }
 
-void printProcess(PartialUserProcess* process) {
-    printf("%-10d | %-10d | %-10d\n", process->pid, process->remainingCpuBurst, process->remainingIoBurst);
+void printTableFooter(std::ostream& out) {
+    out << "----------------------------------------\n";
 }
 
-void printTableFooter() {
-    printf("----------------------------------------\n");
+void printProcesses(const std::vector<PartialUserProcess*>& processes, std::ostream& out) {
+    for (PartialUserProcess* process : processes) {
+        printProcess(process, out);
+    }
 }
 
-void printQueue(std::queue<PartialUserProcess*> queue) {
+void printQueue(std::queue<PartialUserProcess*> queue, std::ostream& out) {
     std::queue<PartialUserProcess*> queueCopy = queue;
     while(!queueCopy.empty()) {
         PartialUserProcess *process = queueCopy.front();
-        printProcess(process);
+        printProcess(process, out);
         queueCopy.pop();
     }
 }
@@ -1,120 +1,215 @@
 #ifndef KERNEL_H
 #define KERNEL_H
 #include "mm.h"
+#include "transport.h"
 #include "utils.h"
+#include "workload.h"
 
 class KernelProcess {
 public:
-  KernelProcess(std::vector<PartialUserProcess *> userProcess, int msgid_str,
-                int msgid_int)
-      : msgid_str(msgid_str), msgid_int(msgid_int), userProcesses(userProcess),
-        memoryManager() {
+  KernelProcess(std::vector<PartialUserProcess *> userProcess,
+                Transport &strTransport, Transport &intTransport,
+                pid_t kernelPid, SimulationOptions options = {})
+      : memoryManager(options), userProcesses(userProcess), strTransport(strTransport),
+        intTransport(intTransport), kernelPid(kernelPid), options(options) {
     for (auto &user : userProcess) {
+      processByPid[user->pid] = user;
       readyQueue.push(user);
     }
   }
 
-  void printQueue(std::queue<PartialUserProcess *> queue) {
+  // Further processes arrive from a workload file while the simulation
+  // runs; `spawn` creates the user process for an entry (NULL on failure).
+  void setWorkload(
+      WorkloadReader *reader,
+      std::function<PartialUserProcess *(const WorkloadEntry &)> spawn) {
+    workload = reader;
+    spawnProcess = spawn;
+  }
+
+  void printQueue(std::queue<PartialUserProcess *> queue, std::ostream &out) {
     std::queue<PartialUserProcess *> queueCopy = queue;
     while (!queueCopy.empty()) {
       PartialUserProcess *process = queueCopy.front();
-      printProcess(process);
+      printProcess(process, out);
       queueCopy.pop();
     }
   }
 
   void logInfo() {
-    std::cout << std::endl;
-    std::cout << "-+-" << std::endl;
-    std::cout << " | ime Tick T :" << totalTimePassed << std::endl;
-    std::cout << " | " << std::endl;
+    if (!logEnabled(LogSubsystem::SCHED, LogLevel::DEBUG))
+      return;
+    std::ostream &out = logStream();
+    out << std::endl;
+    out << "-+-" << std::endl;
+    out << " | ime Tick T :" << totalTimePassed << std::endl;
+    out << " | " << std::endl;
     if (currentCpuProcess)
-      std::cout << "[PID of Process in Running State] "
-                << currentCpuProcess->pid << std::endl;
+      out << "[PID of Process in Running State] " << currentCpuProcess->pid
+          << std::endl;
 
-    std::cout << "[Running Processes Info]";
+    out << "[Running Processes Info]";
     if (currentCpuProcess) {
-      printTableHeader();
-      printProcess(currentCpuProcess);
-      printTableFooter();
+      printTableHeader(out);
+      printProcess(currentCpuProcess, out);
+      printTableFooter(out);
     } else {
-      std::cout << " : None" << std::endl;
+      out << " : None" << std::endl;
     }
 
-    std::cout << "[Ready Queue Info]";
+    out << "[Ready Queue Info]";
     if (!readyQueue.empty()) {
-      printTableHeader();
-      printQueue(readyQueue);
-      printTableFooter();
+      printTableHeader(out);
+      printQueue(readyQueue, out);
+      printTableFooter(out);
     } else {
-      std::cout << " : Empty" << std::endl;
+      out << " : Empty" << std::endl;
     }
   }
 
-  void commandStrHandler(int command, std::vector<char> additionalParams = {}) {
-    switch (command) {
+  // A memory request carries the virtual address, then the bytes to write.
+  void commandStrHandler(const CommandMessage &command) {
+    switch (command.command) {
     case UserCommand::MEMORY_REQUEST:
-      memoryManager.writeToVirtualAddress(additionalParams,
-                                          currentCpuProcess->pid);
+      if (command.paramCount < sizeof(int32_t))
+        break;
+      int32_t virtualAddress;
+      std::memcpy(&virtualAddress, command.payload, sizeof(virtualAddress));
+      std::vector<char> data(command.payload + sizeof(virtualAddress),
+                             command.payload + command.paramCount);
+      memoryManager.writeToVirtualAddress(data, command.sender,
+                                          virtualAddress);
       break;
     }
   }
-  void commandIntHandler(int command, std::vector<int> additionalParams = {}) {
-    switch (command) {
+  // A reborn process gets its descriptor back with the new CPU burst; it is
+  // neither running nor queued once it terminated.
+  void commandIntHandler(const CommandMessage &command) {
+    switch (command.command) {
     case UserCommand::REBORN:
-      PartialUserProcess *rebornProcess = new PartialUserProcess(
-          {additionalParams.at(0), additionalParams.at(1)});
-      readyQueue.push(rebornProcess);
+      if (command.paramCount < 2)
+        break;
+      auto process = processByPid.find(commandParam<int>(command, 0));
+      if (process == processByPid.end()) {
+        std::cerr << "REBORN from unknown process "
+                  << commandParam<int>(command, 0) << ", ignored." << std::endl;
+        break;
+      }
+      PartialUserProcess *rebornProcess = process->second;
+      rebornProcess->remainingCpuBurst = commandParam<int>(command, 1);
+      unsigned rebornDelay =
+          command.paramCount > 2 ? commandParam<int>(command, 2) : 0;
+      rebornQueue.push(
+          {totalTimePassed + rebornDelay, rebornSequence++, rebornProcess});
+    }
+  }
+
+  void arrivalHandlerOnTick() {
+    WorkloadEntry entry;
+    while (workload && workload->nextArrival() &&
+           *workload->nextArrival() <= totalTimePassed &&
+           workload->next(entry)) {
+      PartialUserProcess *process = spawnProcess(entry);
+      if (process) {
+        userProcesses.push_back(process);
+        processByPid[process->pid] = process;
+        readyQueue.push(process);
+      }
+    }
+  }
+
+  void rebornHandlerOnTick() {
+    while (!rebornQueue.empty() &&
+           std::get<0>(rebornQueue.top()) <= totalTimePassed) {
+      readyQueue.push(std::get<2>(rebornQueue.top()));
+      rebornQueue.pop();
     }
   }
 
   void cpuHandlerOnTick() {
     if (currentCpuProcess && currentCpuProcess->remainingCpuBurst <= 0) {
-      sendCommand<int>(msgid_int, currentCpuProcess->pid,
+      sendCommand<int>(intTransport, kernelPid, currentCpuProcess->pid,
                        KernelCommand::DESELECT);
       currentCpuProcess = NULL;
     }
     if (currentCpuProcess) {
       currentCpuProcess->remainingCpuBurst--;
-      sendCommand<int>(msgid_int, currentCpuProcess->pid,
+      sendCommand<int>(intTransport, kernelPid, currentCpuProcess->pid,
                        KernelCommand::EXECUTE_CPU);
     }
     if (!readyQueue.empty() && currentCpuProcess == NULL) {
       currentCpuProcess = readyQueue.front();
       readyQueue.pop();
-      int va = memoryManager.getVirtualAddress(currentCpuProcess->pid);
-      std::cout << "CONTEXT SWITCH! New CPU Process PID : "
-                << currentCpuProcess->pid << " , with VA" << va << std::endl;
-      sendCommand<int>(msgid_int, currentCpuProcess->pid,
+      LOG(SCHED, INFO) << "CONTEXT SWITCH! New CPU Process PID : "
+                       << currentCpuProcess->pid << " , with "
+                       << memoryManager.getPageCount(currentCpuProcess->pid)
+                       << " pages" << std::endl;
+      memoryManager.contextSwitch(currentCpuProcess->pid);
+      sendCommand<int>(intTransport, kernelPid, currentCpuProcess->pid,
                        KernelCommand::SELECT_CPU);
       currentCpuTimePassed = 0;
     }
   }
 
-  void msgIntHandlerOnTick() {
-    auto [command, additionalParams] = receiveCommand<int>(msgid_int, getpid());
-    if (command != -1) {
-      std::cout << "[1] Parent received command " << command << std::endl;
-      commandIntHandler(command, additionalParams);
+  // Moves everything the children sent into the inbox, int messages before
+  // str messages, then handles it in that order up to the per-tick budget.
+  void msgHandlerOnTick() {
+    CommandMessage command;
+    while (receiveCommand<int>(intTransport, kernelPid, command)) {
+      inbox.push({command, false, totalTimePassed});
+    }
+    while (receiveCommand<char>(strTransport, kernelPid, command)) {
+      inbox.push({command, true, totalTimePassed});
+    }
+    inboxDepthSum += inbox.size();
+    inboxDepthMax = std::max(inboxDepthMax, inbox.size());
+    for (unsigned handled = 0;
+         !inbox.empty() &&
+         (options.messageBudget == 0 || handled < options.messageBudget);
+         handled++) {
+      InboxMessage next = inbox.front();
+      inbox.pop();
+      unsigned age = totalTimePassed - next.receivedTick;
+      messagesHandled++;
+      messageAgeSum += age;
+      messageAgeMax = std::max(messageAgeMax, age);
+      LOG(SCHED, DEBUG) << (next.fromStr ? "[2]" : "[1]")
+                        << " Parent received command "
+                        << (int)next.command.command << std::endl;
+      // A delayed memory request may find its sender off the CPU; applying
+      // it would go through the next process's TLB state.
+      if (next.fromStr && (currentCpuProcess == NULL ||
+                           currentCpuProcess->pid != next.command.sender)) {
+        std::cerr << "Memory request from " << next.command.sender
+                  << " which is not running, ignored." << std::endl;
+      } else if (next.fromStr) {
+        commandStrHandler(next.command);
+      } else {
+        commandIntHandler(next.command);
+      }
     }
   }
 
-  void msgStrHandlerOnTick() {
-    auto [command, additionalParams] =
-        receiveCommand<char>(msgid_str, getpid());
-    if (command != -1) {
-      std::cout << "[2] Parent received command " << command << std::endl;
-      commandStrHandler(command, additionalParams);
-    }
+  void logMessageStat() {
+    printf("%-20s | %-10llu\n", "Messages Handled", messagesHandled);
+    printf("%-20s | %-10.2f\n", "Inbox Depth Avg",
+           totalTimePassed ? (double)inboxDepthSum / totalTimePassed : 0.0);
+    printf("%-20s | %-10zu\n", "Inbox Depth Max", inboxDepthMax);
+    printf("%-20s | %-10.2f\n", "Message Age Avg",
+           messagesHandled ? (double)messageAgeSum / messagesHandled : 0.0);
+    printf("%-20s | %-10u\n", "Message Age Max", messageAgeMax);
   }
 
   void tickHandler() {
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
-    std::cout << "Parent Process INIT" << std::endl;
+    // In-process children react synchronously, so ticks need no pacing.
+    if (!options.inProcess)
+      std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    LOG(SCHED, INFO) << "Parent Process INIT" << std::endl;
     logInfo();
     while (totalTimePassed < MAX_TIME_TICK) {
-      msgIntHandlerOnTick();
-      msgStrHandlerOnTick();
+      arrivalHandlerOnTick();
+      msgHandlerOnTick();
+      rebornHandlerOnTick();
       cpuHandlerOnTick();
 
       totalTimePassed++;
@@ -122,21 +217,36 @@ public:
 
       logInfo();
       memoryManager.logMemoryMapping();
-      std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK * 250));
+      // A paced run shows its log tick by tick; the tick sleeps anyway.
+      if (!options.inProcess) {
+        logFlush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK * 250));
+      }
     }
-    std::cout << MAX_TIME_TICK << " Passed!" << std::endl;
+    LOG(SCHED, INFO) << MAX_TIME_TICK << " Passed!" << std::endl;
+    // The results are printed directly, whatever is logged.
+    logSync();
     memoryManager.logPageFaultCnt();
+    memoryManager.logReplacementStat();
+    std::cout << "Random Seed: " << masterSeed() << std::endl;
+    logMessageStat();
+    fflush(stdout);
   }
 
   void run() {
+    // Whatever was logged before the tick thread starts comes first.
+    logFlush();
     thread = std::thread(&KernelProcess::tickHandler, this);
     thread.join();
   }
 
   void exit() {
     for (auto &user : userProcesses) {
-      sendCommand<int>(msgid_int, user->pid, KernelCommand::FORCE_QUIT);
-      waitpid(user->pid, nullptr, 0);
+      sendCommand<int>(intTransport, kernelPid, user->pid,
+                       KernelCommand::FORCE_QUIT);
+      if (!options.inProcess) {
+        waitpid(user->pid, nullptr, 0);
+      }
     }
   }
 
@@ -146,9 +256,34 @@ private:
   unsigned currentCpuTimePassed = 0;
   PartialUserProcess *currentCpuProcess = NULL;
   std::queue<PartialUserProcess *> readyQueue;
+  // (reborn tick, REBORN order, process): processes reborn in the same tick
+  // become ready in the order they asked, not in address order.
+  typedef std::tuple<unsigned, unsigned long long, PartialUserProcess *>
+      RebornEntry;
+  std::priority_queue<RebornEntry, std::vector<RebornEntry>,
+                      std::greater<RebornEntry>>
+      rebornQueue;
+  unsigned long long rebornSequence = 0;
+  // Messages from children, stamped with the tick they were received in.
+  struct InboxMessage {
+    CommandMessage command;
+    bool fromStr;
+    unsigned receivedTick;
+  };
+  std::queue<InboxMessage> inbox;
+  unsigned long long messagesHandled = 0;
+  unsigned long long inboxDepthSum = 0;
+  size_t inboxDepthMax = 0;
+  unsigned long long messageAgeSum = 0;
+  unsigned messageAgeMax = 0;
   std::vector<PartialUserProcess *> userProcesses;
-  int msgid_str;
-  int msgid_int;
+  std::unordered_map<int, PartialUserProcess *> processByPid;
+  Transport &strTransport;
+  Transport &intTransport;
+  pid_t kernelPid;
+  SimulationOptions options;
+  WorkloadReader *workload = NULL;
+  std::function<PartialUserProcess *(const WorkloadEntry &)> spawnProcess;
   std::thread thread;
 };
 
@@ -0,0 +1,245 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Bytes a thread formats before its lines go to the writer.
+#define LOG_BLOCK_SIZE (64 * 1024)
+
+enum class LogLevel { OFF = 0, ERROR = 1, WARN = 2, INFO = 3, DEBUG = 4 };
+
+enum class LogSubsystem { SCHED = 0, MM = 1, CHILD = 2 };
+
+#define LOG_SUBSYSTEMS 3
+
+typedef std::array<LogLevel, LOG_SUBSYSTEMS> LogLevels;
+
+// Highest level each subsystem logs at; everything is logged by default.
+LogLevels logThresholds = {LogLevel::DEBUG, LogLevel::DEBUG, LogLevel::DEBUG};
+
+bool logEnabled(LogSubsystem subsystem, LogLevel level) {
+  return level <= logThresholds[(int)subsystem];
+}
+
+// Writes whole blocks of log lines to stdout on a background thread, so the
+// simulation never waits on the terminal or a pipe. Every process has its own
+// writer; a child forgets the blocks its parent still has to write.
+class LogWriter {
+public:
+  static LogWriter &instance() {
+    static LogWriter writer;
+    return writer;
+  }
+
+  // Queues `block` and leaves it empty.
+  void submit(std::string &block) {
+    if (block.empty())
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    blocks.push_back(std::move(block));
+    block.clear();
+    if (!thread)
+      thread = new std::thread(&LogWriter::run, this);
+    wake.notify_one();
+  }
+
+  // Returns once every block queued so far is written.
+  void sync() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return blocks.empty() && !writing; });
+  }
+
+  ~LogWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      wake.notify_one();
+    }
+    if (thread) {
+      thread->join();
+      delete thread;
+    }
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::deque<std::string> blocks;
+  bool writing = false;
+  bool stopping = false;
+  std::thread *thread = NULL;
+
+  LogWriter() {
+    pthread_atfork(&LogWriter::beforeFork, &LogWriter::afterForkInParent,
+                   &LogWriter::afterForkInChild);
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this] { return !blocks.empty() || stopping; });
+      if (blocks.empty())
+        return;
+      std::string block = std::move(blocks.front());
+      blocks.pop_front();
+      writing = true;
+      lock.unlock();
+      writeAll(block);
+      lock.lock();
+      writing = false;
+      if (blocks.empty())
+        idle.notify_all();
+    }
+  }
+
+  static void writeAll(const std::string &block) {
+    for (size_t written = 0; written < block.size();) {
+      ssize_t count = write(STDOUT_FILENO, block.data() + written,
+                            block.size() - written);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        return;
+      written += count;
+    }
+  }
+
+  static void beforeFork();
+  static void afterForkInParent() { instance().mutex.unlock(); }
+
+  // Only the forking thread lives on in the child, holding the mutex; the
+  // writer thread and whatever it still had to write stay with the parent.
+  static void afterForkInChild() {
+    LogWriter &writer = instance();
+    new (&writer.mutex) std::mutex();
+    new (&writer.wake) std::condition_variable();
+    new (&writer.idle) std::condition_variable();
+    writer.blocks.clear();
+    writer.writing = false;
+    writer.thread = NULL;
+  }
+};
+
+// Lines logged by one thread. Only that thread formats into it, so logging
+// takes no lock; the stream writes straight into the block, and once the block
+// is full its complete lines go to the writer.
+class LogBuffer : public std::streambuf {
+public:
+  LogBuffer() : block(LOG_BLOCK_SIZE, '\0'), stream(this) {
+    LogWriter::instance();
+    setp(&block[0], &block[0] + block.size());
+  }
+
+  ~LogBuffer() { flush(); }
+
+  std::ostream &out() { return stream; }
+
+  void flush() {
+    if (pptr() > pbase())
+      handOff(pptr());
+  }
+
+protected:
+  int overflow(int c) override {
+    if (c == traits_type::eof())
+      return 0;
+    char *lineEnd = pptr();
+    while (lineEnd > pbase() && lineEnd[-1] != '\n')
+      lineEnd--;
+    // A single line longer than the block grows it instead.
+    if (lineEnd == pbase()) {
+      size_t used = pptr() - pbase();
+      block.resize(block.size() * 2);
+      setp(&block[0], &block[0] + block.size());
+      pbump(used);
+    } else {
+      handOff(lineEnd);
+    }
+    *pptr() = c;
+    pbump(1);
+    return c;
+  }
+
+private:
+  std::string block;
+  std::ostream stream;
+
+  // Queues the lines before `end` and starts a new block with the rest.
+  void handOff(char *end) {
+    std::string next(std::max<size_t>(block.size(), LOG_BLOCK_SIZE), '\0');
+    size_t rest = pptr() - end;
+    memcpy(&next[0], end, rest);
+    block.resize(end - pbase());
+    LogWriter::instance().submit(block);
+    block.swap(next);
+    setp(&block[0], &block[0] + block.size());
+    pbump(rest);
+  }
+};
+
+LogBuffer &logBuffer() {
+  thread_local LogBuffer buffer;
+  return buffer;
+}
+
+std::ostream &logStream() { return logBuffer().out(); }
+
+// Hands what this thread logged to the writer, ahead of anything another
+// thread logs afterwards.
+void logFlush() { logBuffer().flush(); }
+
+// Waits until everything logged so far is written, before printing around
+// the log.
+void logSync() {
+  logFlush();
+  LogWriter::instance().sync();
+}
+
+// The blocks this thread logged so far are written by the parent.
+void LogWriter::beforeFork() {
+  logFlush();
+  instance().mutex.lock();
+}
+
+// `LOG(SCHED, INFO) << "..." << std::endl;` The line is neither formatted
+// nor are its operands evaluated unless the subsystem logs at that level.
+#define LOG(subsystem, level)                                                  \
+  if (!logEnabled(LogSubsystem::subsystem, LogLevel::level)) {                 \
+  } else                                                                       \
+    logStream()
+
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+  static const char *names[] = {"off", "error", "warn", "info", "debug"};
+  for (int i = 0; i <= (int)LogLevel::DEBUG; i++) {
+    if (name == names[i]) {
+      level = (LogLevel)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseLogSubsystem(const std::string &name, LogSubsystem &subsystem) {
+  static const char *names[] = {"sched", "mm", "child"};
+  for (int i = 0; i < LOG_SUBSYSTEMS; i++) {
+    if (name == names[i]) {
+      subsystem = (LogSubsystem)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+#endif // LOG_H
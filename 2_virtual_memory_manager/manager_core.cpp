@@ -1,45 +1,155 @@
 #include "utils.h"
 #include "kernel.h"
+#include "pool.h"
+#include "transport.h"
 #include "user.h"
+#include "workload.h"
 
+// Every user process lives in this address space and is driven by the
+// messages the kernel sends it, so the simulation runs on a single thread.
+int runInProcess(const SimulationOptions& options) {
+    LocalTransport strTransport;
+    LocalTransport intTransport;
+    ObjectPool<PartialUserProcess> processPool;
+    std::vector<PartialUserProcess*> childProcesses;
+    std::vector<std::unique_ptr<UserProcess>> inProcessUsers;
+
+    auto spawn = [&](int cpuBurst, const WorkloadEntry* entry) {
+        pid_t pid = IN_PROCESS_KERNEL_PID + 1 + childProcesses.size();
+        inProcessUsers.push_back(std::make_unique<UserProcess>(pid, cpuBurst, strTransport, intTransport, IN_PROCESS_KERNEL_PID, options, childProcesses.size()));
+        UserProcess* userProcess = inProcessUsers.back().get();
+        if (entry) {
+            userProcess->followWorkload(*entry);
+        }
+        intTransport.attach(pid, [&intTransport, userProcess, pid](const message& msg, size_t length) {
+            userProcess->onMessage(msg, length);
+            if (userProcess->isShutDown()) {
+                intTransport.detach(pid);
+            }
+        });
+        childProcesses.push_back(processPool.get(processPool.allocate(pid, cpuBurst)));
+        return childProcesses.back();
+    };
+
+    WorkloadReader workload;
+    bool fromWorkload = !options.workloadPath.empty();
+    if (fromWorkload && !workload.open(options.workloadPath)) {
+        return 1;
+    }
+    for (int i = 0; !fromWorkload && i < options.numProcesses; i++) {
+        RandomStream bursts(RANDOM_BURSTS, i);
+        spawn(bursts.range(MIN_CPU_BURST, MAX_CPU_BURST), nullptr);
+    }
+
+    KernelProcess kernel(childProcesses, strTransport, intTransport, IN_PROCESS_KERNEL_PID, options);
+    if (fromWorkload) {
+        kernel.setWorkload(&workload, [&spawn](const WorkloadEntry& entry) {
+            return spawn(entry.bursts.front(), &entry);
+        });
+    }
+    kernel.run();
+    kernel.exit();
+
+    return 0;
+}
 
-int main () {
-    int msgid_str = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
-    clearMessageQueue(msgid_str);
-    int msgid_int = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
-    clearMessageQueue(msgid_int);
-    
+int main (int argc, char* argv[]) {
+    SimulationOptions options = parseSimulationOptions(argc, argv);
+    if (options.seed) {
+        seedRandom(*options.seed);
+    }
+    logThresholds = options.logLevels;
+    if (options.inProcess) {
+        return runInProcess(options);
+    }
+
+    bool fromWorkload = !options.workloadPath.empty();
+    std::unique_ptr<MessageQueueTransport> strQueue, intQueue;
+    std::unique_ptr<SharedMemoryTransport> strShared, intShared;
+    if (options.transport == "shm") {
+        // The number of workload processes is only known once they arrived.
+        size_t maxPeers = fromWorkload ? SHM_MAX_PEERS : options.numProcesses;
+        strShared = std::make_unique<SharedMemoryTransport>(getpid(), maxPeers);
+        intShared = std::make_unique<SharedMemoryTransport>(getpid(), maxPeers);
+    } else {
+        int msgid_str = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
+        strQueue = std::make_unique<MessageQueueTransport>(msgid_str);
+        strQueue->clear();
+        int msgid_int = msgget(IPC_PRIVATE, 0666 | IPC_CREAT);
+        intQueue = std::make_unique<MessageQueueTransport>(msgid_int);
+        intQueue->clear();
+        LOG(SCHED, INFO) << "msgid_str" << msgid_str << "msgid_int" << msgid_int << std::endl;
+    }
+    Transport& strTransport = strShared ? static_cast<Transport&>(*strShared) : *strQueue;
+    Transport& intTransport = intShared ? static_cast<Transport&>(*intShared) : *intQueue;
+
+    ObjectPool<PartialUserProcess> processPool;
     std::vector<PartialUserProcess*> childProcesses;
 
-    std::cout << "msgid_str" << msgid_str << "msgid_int" << msgid_int << std::endl;
-    
-    pid_t pid;
-    for (int i = 0; i < 10; i++) {
-        int randomCpuBurst = randomRange(MIN_CPU_BURST, MAX_CPU_BURST);
-        pid = fork();
+    auto spawn = [&](int cpuBurst, const WorkloadEntry* entry) -> PartialUserProcess* {
+        int slot = 0;
+        if (intShared) {
+            slot = intShared->reserveSlot();
+            strShared->reserveSlot();
+        }
+        if (slot < 0) {
+            std::cerr << "No shared ring left for a new process" << std::endl;
+            return NULL;
+        }
+        uint64_t streamId = childProcesses.size();
+        pid_t pid = fork();
         if (pid == 0) { // child process
-            UserProcess userProcess(getpid(), randomCpuBurst, msgid_str, msgid_int);
+            if (intShared) {
+                strShared->becomePeer(slot);
+                intShared->becomePeer(slot);
+            }
+            UserProcess userProcess(getpid(), cpuBurst, strTransport, intTransport, getppid(), options, streamId);
+            if (entry) {
+                userProcess.followWorkload(*entry);
+            }
             userProcess.run();
             exit(0);
-        } else if (pid > 0) { // kernel process
-            PartialUserProcess* partialChildProcess = new PartialUserProcess{pid, randomCpuBurst};
-            childProcesses.push_back(partialChildProcess);
-        } else {
+        } else if (pid < 0) {
             std::cerr << "Fork failed" << std::endl;
+            return NULL;
+        }
+        // kernel process
+        if (intShared) {
+            strShared->bindPeer(slot, pid);
+            intShared->bindPeer(slot, pid);
         }
+        PartialUserProcess* partialChildProcess = processPool.get(processPool.allocate(pid, cpuBurst));
+        childProcesses.push_back(partialChildProcess);
+        return partialChildProcess;
+    };
+
+    WorkloadReader workload;
+    if (fromWorkload && !workload.open(options.workloadPath)) {
+        return 1;
+    }
+    for (int i = 0; !fromWorkload && i < options.numProcesses; i++) {
+        RandomStream bursts(RANDOM_BURSTS, i);
+        spawn(bursts.range(MIN_CPU_BURST, MAX_CPU_BURST), nullptr);
+    }
+
+    KernelProcess kernel(childProcesses, strTransport, intTransport, getpid(), options);
+    if (fromWorkload) {
+        kernel.setWorkload(&workload, [&spawn](const WorkloadEntry& entry) {
+            return spawn(entry.bursts.front(), &entry);
+        });
     }
-    
-    KernelProcess kernel(childProcesses, msgid_str, msgid_int);
     kernel.run();
     kernel.exit();
 
-    for (auto* child : childProcesses) {
-        delete child;
+    if (intShared) {
+        strShared->close();
+        intShared->close();
+    } else {
+        strQueue->clear();
+        intQueue->clear();
+        strQueue->remove();
+        intQueue->remove();
     }
-    clearMessageQueue(msgid_str);
-    clearMessageQueue(msgid_int);
-    msgctl(msgid_str, IPC_RMID, NULL);
-    msgctl(msgid_int, IPC_RMID, NULL);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,188 +1,313 @@
 #ifndef MM_H
 #define MM_H
+#include "page.h"
 #include "pm.h"
+#include "pool.h"
+#include "replacement.h"
+#include "tlb.h"
 #include "utils.h"
 
-class Page {
+// One radix tree per process, indexed by virtual page number: every level
+// takes PAGE_TABLE_LEVEL_BITS of it, from the top. Nodes are created on the
+// first mapping below them, so a sparse address space only pays for the
+// paths it uses. Page entries live in a pool owned by the table, so adding
+// one reuses a free slot instead of allocating.
+class PageTable {
 public:
-  Page(int virtualAddress, int physicalAddress)
-      : virtualAddress(virtualAddress), physicalAddress(physicalAddress),
-        validBit(false), referenceBit(false), modifiedBit(false),
-        hardDiskAddress(-1), swappedOut(false) {
-    std::cout << "Page created with VA: " << virtualAddress
-              << " and PA: " << physicalAddress << std::endl;
-  }
-
-  int getVirtualAddress() const { return virtualAddress; }
-  int getPhysicalAddress() const { return physicalAddress; }
-  bool isValid() const { return validBit; }
-  bool isReferenced() const { return referenceBit; }
-  bool isModified() const { return modifiedBit; }
-
-  void setPhysicalAddress(int addr) { physicalAddress = addr; }
-  void setValid(bool valid) { validBit = valid; }
-  void setReferenced(bool referenced) { referenceBit = referenced; }
-  void setModified(bool modified) { modifiedBit = modified; }
-
-  int getHardDiskAddress() const { return hardDiskAddress; }
-  void setHardDiskAddress(int addr) { hardDiskAddress = addr; }
-  bool isSwappedOut() const { return swappedOut; }
-  void setSwappedOut(bool swapped) { swappedOut = swapped; }
+  PageTable() {}
+
+  // The entry for `virtualPage`, nullptr if the page was never mapped.
+  Page *lookup(pid_t pid, int virtualPage) const {
+    auto root = roots.find(pid);
+    if (root == roots.end()) {
+      return nullptr;
+    }
+    const Node *node = root->second.get();
+    for (int level = 0; level + 1 < PAGE_TABLE_LEVELS; level++) {
+      node = node->children[indexAt(virtualPage, level)].get();
+      if (node == nullptr) {
+        return nullptr;
+      }
+    }
+    return node->pages[indexAt(virtualPage, PAGE_TABLE_LEVELS - 1)];
+  }
+
+  Page *addPage(pid_t pid, int virtualPage, int physicalAddress) {
+    std::unique_ptr<Node> &root = roots[pid];
+    if (!root) {
+      root = std::make_unique<Node>(0);
+    }
+    Node *node = root.get();
+    for (int level = 0; level + 1 < PAGE_TABLE_LEVELS; level++) {
+      std::unique_ptr<Node> &child = node->children[indexAt(virtualPage, level)];
+      if (!child) {
+        child = std::make_unique<Node>(level + 1);
+        nodeCount++;
+      }
+      node = child.get();
+    }
+    Page *page = pagePool.get(pagePool.allocate(
+        pid, virtualPage << PAGE_OFFSET_BITS, physicalAddress));
+    LOG(MM, INFO) << "Page created for PID " << pid << " with VA: "
+                  << page->getVirtualAddress() << " and PA: " << physicalAddress
+                  << std::endl;
+    node->pages[indexAt(virtualPage, PAGE_TABLE_LEVELS - 1)] = page;
+    pages.push_back(page);
+    pageCounts[pid]++;
+    return page;
+  }
+
+  // Every entry, in the order the pages were first mapped.
+  const std::vector<Page *> &getPages() const { return pages; }
+
+  size_t pageCount(pid_t pid) const {
+    auto count = pageCounts.find(pid);
+    return count == pageCounts.end() ? 0 : count->second;
+  }
+
+  // Tables of all processes, the roots included.
+  size_t tableCount() const { return roots.size() + nodeCount; }
 
 private:
-  int virtualAddress;
-  int physicalAddress;
-  bool validBit;
-  bool referenceBit;
-  bool modifiedBit;
-  int hardDiskAddress;
-  bool swappedOut;
+  // Inner levels point to the next level, the last one to page entries.
+  struct Node {
+    explicit Node(int level) {
+      if (level + 1 < PAGE_TABLE_LEVELS) {
+        children.resize(PAGE_TABLE_FANOUT);
+      } else {
+        pages.resize(PAGE_TABLE_FANOUT, nullptr);
+      }
+    }
+    std::vector<std::unique_ptr<Node>> children;
+    std::vector<Page *> pages;
+  };
+
+  ObjectPool<Page> pagePool;
+  std::unordered_map<pid_t, std::unique_ptr<Node>> roots;
+  std::unordered_map<pid_t, size_t> pageCounts;
+  std::vector<Page *> pages;
+  size_t nodeCount = 0;
+
+  static int indexAt(int virtualPage, int level) {
+    int shift = (PAGE_TABLE_LEVELS - 1 - level) * PAGE_TABLE_LEVEL_BITS;
+    return (virtualPage >> shift) & (PAGE_TABLE_FANOUT - 1);
+  }
 };
 
-class PageTable {
+// Reverse map of physical memory: the page each frame holds, kept on every
+// map, swap-in and swap-out, so the owner of an evicted frame is found
+// without searching the page tables.
+class FrameTable {
 public:
-  PageTable() {}
-  ~PageTable() {
-    for (auto &entry : pages) {
-      delete entry.second;
-    }
-  }
+  explicit FrameTable(size_t frames) : pages(frames, nullptr) {}
 
-  void addPage(pid_t pid, int virtualAddress, int physicalAddress) {
-    Page *page = new Page(virtualAddress, physicalAddress);
-    pages.insert(std::make_pair(pid, page));
+  // The page in `frame`, nullptr if the frame is free.
+  Page *owner(size_t frame) const {
+    return frame < pages.size() ? pages[frame] : nullptr;
   }
 
-  const std::map<pid_t, Page *> &getPages() const { return pages; }
+  void map(size_t frame, Page *page) {
+    if (frame < pages.size()) {
+      pages[frame] = page;
+    }
+  }
 
-  Page *getPage(pid_t pid) {
-    auto it = pages.find(pid);
-    if (it != pages.end()) {
-      return it->second;
+  // Frees `frame` and returns the page it held.
+  Page *unmap(size_t frame) {
+    Page *page = owner(frame);
+    if (page) {
+      pages[frame] = nullptr;
     }
-    return nullptr;
+    return page;
   }
 
 private:
-  std::map<pid_t, Page *> pages;
+  std::vector<Page *> pages;
 };
 
 class MemoryManager {
 public:
-  MemoryManager() : physicalMemory(MEMORY_SIZE), hardDisk(DISK_SIZE) {
-    std::cout << "MemoryManager initialized with memory size: " << MEMORY_SIZE
-              << " and disk size: " << DISK_SIZE << std::endl;
+  explicit MemoryManager(const SimulationOptions &options)
+      : physicalMemory(options.memoryFrames, PAGE_SIZE),
+        hardDisk(DISK_SIZE, PAGE_SIZE), frameTable(options.memoryFrames),
+        tlb(options),
+        replacementName(options.replacement),
+        replacement(makeReplacementPolicy(options.replacement,
+                                          options.memoryFrames)) {
+    LOG(MM, INFO) << "MemoryManager initialized with memory size: "
+                  << options.memoryFrames << " and disk size: " << DISK_SIZE
+                  << " pages of " << PAGE_SIZE << " bytes" << std::endl;
   }
 
-  int getVirtualAddress(pid_t pid) {
-    int virtualAddress = determineVirtualAddress(pid);
-    return virtualAddress;
-  }
+  size_t getPageCount(pid_t pid) const { return pageTable.pageCount(pid); }
 
-  void writeToVirtualAddress(const std::vector<char> &data, pid_t pid) {
-    Page *page = pageTable.getPage(pid);
+  // `pid` gets the CPU; the TLB drops or keeps the previous translations.
+  void contextSwitch(pid_t pid) { tlb.contextSwitch(pid); }
+
+  // Writes `data` at `virtualAddress` of process `pid`, faulting the page in
+  // first if it is not resident. The data must not cross a page boundary.
+  void writeToVirtualAddress(const std::vector<char> &data, pid_t pid,
+                             int virtualAddress) {
+    int offset = virtualAddress & (PAGE_SIZE - 1);
+    if (virtualAddress < 0 ||
+        virtualAddress >= VIRTUAL_PAGES * PAGE_SIZE ||
+        offset + data.size() > PAGE_SIZE) {
+      std::cerr << "Invalid access of " << data.size() << " bytes at VA "
+                << virtualAddress << " by PID " << pid << ", ignored."
+                << std::endl;
+      return;
+    }
+    Page *page = translate(pid, virtualAddress >> PAGE_OFFSET_BITS);
     if (page && page->isValid()) {
-      int physicalAddress = page->getPhysicalAddress();
-      physicalMemory.writeToAddress(physicalAddress, data);
+      physicalMemory.writeToAddress(page->getPhysicalAddress(), data, offset);
       page->setModified(true);
     }
   }
 
   void logMemoryMapping() {
-    std::cout << "VA to PA Mapping:" << std::endl;
-    for (const auto &ptEntry : pageTable.getPages()) {
-      pid_t pid = ptEntry.first;
-      const Page *page = ptEntry.second;
-      std::cout << "PID: " << pid << "\t";
+    if (!logEnabled(LogSubsystem::MM, LogLevel::DEBUG))
+      return;
+    std::ostream &out = logStream();
+    out << "VA to PA Mapping:" << std::endl;
+    for (const Page *page : pageTable.getPages()) {
+      out << "PID: " << page->getPid() << "\t";
       int va = page->getVirtualAddress();
-      int pa = page->getPhysicalAddress();
-      std::cout << "VA(" << va << ") -> PA(" << pa
-                << "), valid: " << (page->isValid() ? "o" : "x")
-                << ", modified: " << (page->isModified() ? "o" : "x")
-                << ", referenced: " << (page->isReferenced() ? "o" : "x")
-                << ", hardDisk: " << page->getHardDiskAddress() << std::endl;
+      int pa = page->getPhysicalAddress() * PAGE_SIZE;
+      out << "VA(" << va << ") -> PA(" << pa
+          << "), valid: " << (page->isValid() ? "o" : "x")
+          << ", modified: " << (page->isModified() ? "o" : "x")
+          << ", referenced: " << (page->isReferenced() ? "o" : "x")
+          << ", hardDisk: " << page->getHardDiskAddress() << std::endl;
     }
-    std::cout << "[Physical Memory]" << std::endl;
-    physicalMemory.logInfo();
-    std::cout << "[Hard Disk]" << std::endl;
-    hardDisk.logInfo();
+    out << "[Physical Memory]" << std::endl;
+    physicalMemory.logInfo(out);
+    out << "[Hard Disk]" << std::endl;
+    hardDisk.logInfo(out);
   }
 
   void logPageFaultCnt() {
     std::cout << "Total Page Fault Count: " << pageFaultCnt << std::endl;
+    std::cout << "Memory Accesses: " << memoryAccesses << std::endl;
+    printf("Page Fault Rate: %.2f%%\n",
+           memoryAccesses ? pageFaultCnt * 100.0 / memoryAccesses : 0.0);
+    fflush(stdout);
+    std::cout << "Pages Mapped: " << pageTable.getPages().size()
+              << ", Page Tables: " << pageTable.tableCount() << std::endl;
+    tlb.logStat();
+  }
+
+  // Replays the accesses of this run with every policy on the same memory.
+  void logReplacementStat() {
+    std::cout << "Page Faults by Policy (" << replacementName
+              << " ran):" << std::endl;
+    for (const char *name : REPLACEMENT_POLICIES) {
+      printf("%-20s | %-10llu\n", name,
+             replayFaults(name, accessTrace, physicalMemory.getSize()));
+    }
+    fflush(stdout);
   }
 
 private:
   RealMemory physicalMemory;
   RealMemory hardDisk;
   PageTable pageTable;
-  std::queue<size_t> fifoQueue;
-  int lastUpdatedVA = 0;
+  FrameTable frameTable;
+  Tlb tlb;
+  std::string replacementName;
+  std::unique_ptr<ReplacementPolicy> replacement;
   int pageFaultCnt = 0;
+  unsigned long long memoryAccesses = 0;
+  // The page of every access, for replaying it with other policies.
+  std::vector<const Page *> accessTrace;
 
-  int determineVirtualAddress(pid_t pid) { // 메모리에 프로세스가 붙으면 실행됨
-    Page *page = pageTable.getPage(pid);
-    if (page == nullptr || !page->isValid()) {
-      pageFaultCnt++;
-      if (page == nullptr) { // 없으면 처음으로 생성
-        handlePageFault(pid, lastUpdatedVA);
-        lastUpdatedVA++;
-      } else { // page->isValid()가 false인 경우. 한 번 할당되었으나 swap out된 경우
-        loadPageFromDisk(page);
+  // The resident entry for `virtualPage`, from the TLB or a page table walk.
+  // A page is mapped to a fresh frame on the first touch or loaded back from
+  // disk if it was swapped out. Every access sets the reference bit.
+  Page *translate(pid_t pid, int virtualPage) {
+    memoryAccesses++;
+    Page *page = tlb.lookup(pid, virtualPage);
+    bool faulted = false;
+    if (page == nullptr) {
+      page = pageTable.lookup(pid, virtualPage);
+      if (page == nullptr || !page->isValid()) {
+        pageFaultCnt++;
+        faulted = true;
+        if (page == nullptr) { // 없으면 처음으로 생성
+          page = handlePageFault(pid, virtualPage);
+        } else { // page->isValid()가 false인 경우. 한 번 할당되었으나 swap out된 경우
+          loadPageFromDisk(page);
+        }
+      }
+      if (page->isValid()) {
+        tlb.insert(pid, virtualPage, page);
       }
-      page = pageTable.getPage(pid);
     }
-    return page->getVirtualAddress();
+    if (page->isValid()) {
+      accessTrace.push_back(page);
+      page->setReferenced(true);
+      if (!faulted) {
+        replacement->onAccess(page->getPhysicalAddress());
+      }
+    }
+    return page;
   }
 
-  void handlePageFault(pid_t pid, int virtualAddress) {
-    std::cout << "Handling PAGE FAULT for PID: " << pid << " at VA "
-              << virtualAddress << std::endl;
+  Page *handlePageFault(pid_t pid, int virtualPage) {
+    LOG(MM, INFO) << "Handling PAGE FAULT for PID: " << pid << " at VA "
+                  << (virtualPage << PAGE_OFFSET_BITS) << std::endl;
 
     if (physicalMemory.isFull()) {
-      std::cout << "The PAGE FAULT reason was physical memory is full."
-                << std::endl;
-      swapPages();
+      LOG(MM, INFO) << "The PAGE FAULT reason was physical memory is full."
+                    << std::endl;
+      swapPages(nullptr);
     }
 
     size_t physicalAddress = physicalMemory.getFirstEmptyAddress();
-    if (physicalAddress == MEMORY_SIZE) {
-      swapPages();
+    if (physicalAddress >= physicalMemory.getSize()) {
+      swapPages(nullptr);
       physicalAddress = physicalMemory.getFirstEmptyAddress();
     }
+    // The frame is taken even before anything is written to it.
+    physicalMemory.markUsed(physicalAddress, true);
 
-    pageTable.addPage(pid, virtualAddress, physicalAddress);
-    Page *page = pageTable.getPage(pid);
-
+    Page *page = pageTable.addPage(pid, virtualPage, physicalAddress);
     page->setValid(true);
-    page->setPhysicalAddress(physicalAddress);
+    frameTable.map(physicalAddress, page);
 
-    fifoQueue.push(physicalAddress);
+    replacement->onLoad(physicalAddress, page);
+    return page;
   }
 
-  void swapPages() {
-    std::cout << "Swapping pages using FIFO..." << std::endl;
-    while (!fifoQueue.empty() && physicalMemory.isFull()) {
-      size_t oldAddress = fifoQueue.front();
-      fifoQueue.pop();
+  // Evicts one page if physical memory is full to make room for `incoming`,
+  // nullptr for a page mapped for the first time.
+  void swapPages(const Page *incoming) {
+    if (physicalMemory.isFull()) {
+      LOG(MM, INFO) << "Swapping pages using " << replacementName << "..."
+                    << std::endl;
+      size_t oldAddress = replacement->evict(incoming);
       auto pageData = physicalMemory.getValue(oldAddress);
       if (pageData.has_value()) {
         size_t diskAddress = hardDisk.getFirstEmptyAddress();
+        if (diskAddress >= DISK_SIZE) {
+          std::cerr << "Error: Hard disk is full, PA " << oldAddress
+                    << " is lost" << std::endl;
+        }
         hardDisk.writeToAddress(diskAddress, pageData.value());
-        std::cout << "Swapping out PA: " << oldAddress
-                  << " to Hard Disk: " << diskAddress << std::endl;
+        LOG(MM, INFO) << "Swapping out PA: " << oldAddress
+                      << " to Hard Disk: " << diskAddress << std::endl;
         physicalMemory.flushAddress(oldAddress);
-        for (auto &entry : pageTable.getPages()) {
-          Page *page = entry.second;
-          if (page->getPhysicalAddress() == oldAddress &&
-              page->isValid()) { // 오직 하나 존재
-            std::cout << "Swapped PID: " << entry.first << std::endl;
-            page->setSwappedOut(true);
-            page->setValid(false);
-            page->setHardDiskAddress(diskAddress);
-            break;
-          }
+        Page *page = frameTable.unmap(oldAddress);
+        if (page == nullptr) {
+          std::cerr << "Error: No page maps PA " << oldAddress << std::endl;
+          return;
         }
+        LOG(MM, INFO) << "Swapped PID: " << page->getPid() << " VA: "
+                      << page->getVirtualAddress() << std::endl;
+        page->setSwappedOut(true);
+        page->setValid(false);
+        page->setReferenced(false);
+        tlb.invalidate(page->getVirtualAddress() >> PAGE_OFFSET_BITS, page);
+        page->setHardDiskAddress(diskAddress);
       } else {
         std::cerr << "Error: Failed to get page data from physical memory"
                   << std::endl;
@@ -196,20 +321,22 @@ private:
       return;
     }
 
-    swapPages();
+    swapPages(page);
     size_t newPhysicalAddress = physicalMemory.getFirstEmptyAddress();
     size_t diskAddress = page->getHardDiskAddress();
     auto pageData = hardDisk.getValue(diskAddress);
 
     if (pageData.has_value()) {
-      std::cout << "Load page from disk: " << diskAddress
-                << " to physical memory: " << newPhysicalAddress << std::endl;
+      LOG(MM, INFO) << "Load page from disk: " << diskAddress
+                    << " to physical memory: " << newPhysicalAddress
+                    << std::endl;
       physicalMemory.writeToAddress(newPhysicalAddress, pageData.value());
       page->setSwappedOut(false);
       page->setPhysicalAddress(newPhysicalAddress);
       page->setValid(true);
       page->setHardDiskAddress(-1);
-      fifoQueue.push(newPhysicalAddress);
+      frameTable.map(newPhysicalAddress, page);
+      replacement->onLoad(newPhysicalAddress, page);
       hardDisk.flushAddress(diskAddress);
     } else {
       std::cerr << "Error: Failed to load page data from disk" << std::endl;
@@ -217,4 +344,4 @@ private:
   }
 };
 
-#endif // MM_H
\ No newline at end of file
+#endif // MM_H
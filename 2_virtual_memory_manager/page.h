@@ -0,0 +1,43 @@
+#ifndef PAGE_H
+#define PAGE_H
+#include "utils.h"
+
+// A page table entry.
+class Page {
+public:
+  Page(pid_t pid, int virtualAddress, int physicalAddress)
+      : pid(pid), virtualAddress(virtualAddress),
+        physicalAddress(physicalAddress), validBit(false),
+        referenceBit(false), modifiedBit(false), hardDiskAddress(-1),
+        swappedOut(false) {}
+
+  pid_t getPid() const { return pid; }
+  // First virtual address of the page and the frame it is mapped to.
+  int getVirtualAddress() const { return virtualAddress; }
+  int getPhysicalAddress() const { return physicalAddress; }
+  bool isValid() const { return validBit; }
+  bool isReferenced() const { return referenceBit; }
+  bool isModified() const { return modifiedBit; }
+
+  void setPhysicalAddress(int addr) { physicalAddress = addr; }
+  void setValid(bool valid) { validBit = valid; }
+  void setReferenced(bool referenced) { referenceBit = referenced; }
+  void setModified(bool modified) { modifiedBit = modified; }
+
+  int getHardDiskAddress() const { return hardDiskAddress; }
+  void setHardDiskAddress(int addr) { hardDiskAddress = addr; }
+  bool isSwappedOut() const { return swappedOut; }
+  void setSwappedOut(bool swapped) { swappedOut = swapped; }
+
+private:
+  pid_t pid;
+  int virtualAddress;
+  int physicalAddress;
+  bool validBit;
+  bool referenceBit;
+  bool modifiedBit;
+  int hardDiskAddress;
+  bool swappedOut;
+};
+
+#endif // PAGE_H
@@ -1,86 +1,140 @@
 #ifndef PHYSICAL_MEMORY_H
 #define PHYSICAL_MEMORY_H
 
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <optional>
 #include <vector>
 
-class RealMemory {
+#include "log.h"
+
+// Which of `size` slots are in use, as a hierarchy of 64-bit words: a bit of
+// level 0 is set when its slot is used, a bit of level k when the word below
+// it on level k - 1 is full. The top level is a single word. The first free
+// slot is found by following the first zero bit down from the top, one word
+// per level, so it takes four reads at 16M slots. Padding bits past the
+// last slot count as used.
+class SlotBitmap {
 public:
-  explicit RealMemory(size_t size) : size(size), memory(new char[size * 4]) {
-    std::memset(memory, 0, size * 4);
-    std::cout << "RealMemory Size: " << size << " addresses" << std::endl;
-    for (int i = 0; i < size; i++) {
-      used.push_back(false);
+  explicit SlotBitmap(size_t size) : size(size), freeCount(size) {
+    size_t bits = size;
+    do {
+      size_t words = (bits + 63) / 64;
+      levels.emplace_back(words, 0);
+      if (bits % 64) {
+        levels.back().back() = ~0ULL << (bits % 64);
+      }
+      bits = words;
+    } while (bits > 1);
+  }
+
+  bool isUsed(size_t slot) const {
+    return levels[0][slot / 64] >> (slot % 64) & 1;
+  }
+
+  // The lowest free slot, `size` if all are used.
+  size_t firstFree() const {
+    if (freeCount == 0) {
+      return size;
     }
+    size_t slot = 0;
+    for (size_t level = levels.size(); level-- > 0;) {
+      slot = slot * 64 + __builtin_ctzll(~levels[level][slot]);
+    }
+    return slot;
+  }
+
+  size_t freeSlots() const { return freeCount; }
+
+  void set(size_t slot, bool used) {
+    if (slot >= size || isUsed(slot) == used) {
+      return;
+    }
+    freeCount += used ? -1 : 1;
+    for (std::vector<uint64_t> &level : levels) {
+      uint64_t &word = level[slot / 64];
+      bool wasFull = word == ~0ULL;
+      word ^= 1ULL << (slot % 64);
+      // The level above only changes when this word fills up or opens.
+      if (wasFull == (word == ~0ULL)) {
+        return;
+      }
+      slot /= 64;
+    }
+  }
+
+private:
+  size_t size;
+  size_t freeCount;
+  std::vector<std::vector<uint64_t>> levels;
+};
+
+// `size` frames of `frameSize` bytes each; an address names a frame.
+class RealMemory {
+public:
+  RealMemory(size_t size, size_t frameSize)
+      : size(size), frameSize(frameSize), memory(new char[size * frameSize]),
+        used(size) {
+    std::memset(memory, 0, size * frameSize);
+    LOG(MM, INFO) << "RealMemory Size: " << size << " addresses" << std::endl;
   }
 
   ~RealMemory() { delete[] memory; }
 
-  void logInfo() {
+  void logInfo(std::ostream &out) {
     for (size_t i = 0; i < size; ++i) {
-      if (used[i]) {
-        std::cout << "Address " << i << " | Data: ";
-        for (size_t j = 0; j < 4; ++j) {
-          char c = memory[i * 4 + j];
+      if (used.isUsed(i)) {
+        out << "Address " << i << " | Data: ";
+        for (size_t j = 0; j < frameSize; ++j) {
+          char c = memory[i * frameSize + j];
           if (c != '\0')
-            std::cout << c;
+            out << c;
         }
-        std::cout << std::endl;
+        out << std::endl;
       }
     }
   }
 
-  void writeToAddress(size_t address, const std::vector<char> &value) {
-    if (address < size && value.size() <= 4) {
-      std::memcpy(memory + address * 4, value.data(), value.size());
+  void writeToAddress(size_t address, const std::vector<char> &value,
+                      size_t offset = 0) {
+    if (address < size && offset + value.size() <= frameSize) {
+      std::memcpy(memory + address * frameSize + offset, value.data(),
+                  value.size());
       markUsed(address, true);
     }
   }
 
   void flushAddress(size_t address) {
     if (address < size) {
-      std::memset(memory + address * 4, 0, 4);
+      std::memset(memory + address * frameSize, 0, frameSize);
       markUsed(address, false);
     }
   }
 
+  // The whole frame at `address`.
   std::optional<std::vector<char>> getValue(size_t address) {
     if (address < size) {
-      return std::vector<char>(memory + address * 4, memory + address * 4 + 4);
+      return std::vector<char>(memory + address * frameSize,
+                               memory + (address + 1) * frameSize);
     }
     return std::nullopt;
   }
 
-  size_t getFirstEmptyAddress() {
-    for (size_t i = 0; i < size; ++i) {
-      if (!used[i]) {
-        return i;
-      }
-    }
-    return -1;
-  }
+  size_t getSize() const { return size; }
 
-  bool isFull() {
-    for (size_t i = 0; i < size; ++i) {
-      if (!used[i]) {
-        return false;
-      }
-    }
-    return true;
-  }
+  // The lowest free address, getSize() if there is none.
+  size_t getFirstEmptyAddress() const { return used.firstFree(); }
 
-  void markUsed(size_t address, bool state) {
-    if (address < size) {
-      used[address] = state;
-    }
-  }
+  bool isFull() const { return used.freeSlots() == 0; }
+
+  void markUsed(size_t address, bool state) { used.set(address, state); }
 
 private:
   size_t size;
+  size_t frameSize;
   char *memory;
-  std::vector<bool> used;
+  SlotBitmap used;
 };
 
 #endif // PHYSICAL_MEMORY_H
@@ -0,0 +1,101 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "utils.h"
+
+#define POOL_SLAB_SIZE 256
+
+// Fixed-size objects carved out of slabs that are never moved or returned
+// while the pool lives, so pointers stay valid and a released slot is reused
+// by the next allocation instead of going back to the heap. A handle names a
+// slot and the generation it was allocated in; once the slot is released and
+// reused, the old handle no longer resolves.
+template <typename T> class ObjectPool {
+public:
+  struct Handle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+  };
+
+  ObjectPool() = default;
+  ObjectPool(const ObjectPool &) = delete;
+  ObjectPool &operator=(const ObjectPool &) = delete;
+
+  ~ObjectPool() {
+    for (uint32_t index = 0; index < slots(); index++) {
+      if (slot(index).live)
+        object(index)->~T();
+    }
+  }
+
+  template <typename... Args> Handle allocate(Args &&...args) {
+    if (freeHead == UINT32_MAX)
+      grow();
+    uint32_t index = freeHead;
+    Slot &free = slot(index);
+    freeHead = free.nextFree;
+    new (free.storage) T{std::forward<Args>(args)...};
+    free.live = true;
+    live++;
+    return {index, free.generation};
+  }
+
+  void release(Handle handle) {
+    if (!get(handle))
+      return;
+    Slot &used = slot(handle.index);
+    object(handle.index)->~T();
+    used.live = false;
+    used.generation++;
+    used.nextFree = freeHead;
+    freeHead = handle.index;
+    live--;
+  }
+
+  // The object behind `handle`, NULL if it was released.
+  T *get(Handle handle) {
+    if (!handle.valid() || handle.index >= slots())
+      return NULL;
+    Slot &used = slot(handle.index);
+    return used.live && used.generation == handle.generation
+               ? object(handle.index)
+               : NULL;
+  }
+
+  size_t size() const { return live; }
+  size_t capacity() const { return slots(); }
+
+private:
+  struct Slot {
+    alignas(T) unsigned char storage[sizeof(T)];
+    uint32_t generation = 0;
+    uint32_t nextFree = UINT32_MAX;
+    bool live = false;
+  };
+
+  std::vector<std::unique_ptr<Slot[]>> slabs;
+  uint32_t freeHead = UINT32_MAX;
+  size_t live = 0;
+
+  uint32_t slots() const { return slabs.size() * POOL_SLAB_SIZE; }
+  Slot &slot(uint32_t index) {
+    return slabs[index / POOL_SLAB_SIZE][index % POOL_SLAB_SIZE];
+  }
+  T *object(uint32_t index) {
+    return reinterpret_cast<T *>(slot(index).storage);
+  }
+
+  // Threads the new slab's slots onto the free list in index order.
+  void grow() {
+    uint32_t first = slots();
+    slabs.push_back(std::make_unique<Slot[]>(POOL_SLAB_SIZE));
+    for (uint32_t i = POOL_SLAB_SIZE; i-- > 0;) {
+      slot(first + i).nextFree = freeHead;
+      freeHead = first + i;
+    }
+  }
+};
+
+#endif // POOL_H
@@ -0,0 +1,311 @@
+#ifndef REPLACEMENT_H
+#define REPLACEMENT_H
+#include "page.h"
+#include "utils.h"
+#include <list>
+#include <set>
+
+// Chooses the frame to evict when physical memory is full. The memory
+// manager reports every page it loads into a frame and every access to a
+// resident page, in access order, after setting the page's reference bit.
+class ReplacementPolicy {
+public:
+  virtual ~ReplacementPolicy() {}
+
+  // `page` was loaded into `frame`.
+  virtual void onLoad(size_t frame, Page *page) = 0;
+  // The page in `frame` was accessed again.
+  virtual void onAccess(size_t frame) = 0;
+  // Forgets a resident page and returns its frame. `incoming` is the page
+  // that will be loaded instead, nullptr if it is mapped for the first time.
+  virtual size_t evict(const Page *incoming) = 0;
+};
+
+// Evicts the page loaded first.
+class FifoPolicy : public ReplacementPolicy {
+public:
+  void onLoad(size_t frame, Page *) override { frames.push(frame); }
+  void onAccess(size_t) override {}
+  size_t evict(const Page *) override {
+    size_t frame = frames.front();
+    frames.pop();
+    return frame;
+  }
+
+private:
+  std::queue<size_t> frames;
+};
+
+// Second chance: the hand sweeps the frames in order, clearing reference
+// bits, and evicts the first page it finds unreferenced.
+class ClockPolicy : public ReplacementPolicy {
+public:
+  explicit ClockPolicy(size_t frames) : pages(frames, nullptr) {}
+
+  void onLoad(size_t frame, Page *page) override { pages[frame] = page; }
+  void onAccess(size_t) override {}
+  size_t evict(const Page *) override {
+    while (pages[hand] == nullptr || pages[hand]->isReferenced()) {
+      if (pages[hand]) {
+        pages[hand]->setReferenced(false);
+      }
+      hand = (hand + 1) % pages.size();
+    }
+    size_t frame = hand;
+    pages[frame] = nullptr;
+    hand = (hand + 1) % pages.size();
+    return frame;
+  }
+
+private:
+  std::vector<Page *> pages;
+  size_t hand = 0;
+};
+
+// Evicts the page used least recently. The frames are kept in use order,
+// each with its position in the list, so every operation is O(1).
+class LruPolicy : public ReplacementPolicy {
+public:
+  void onLoad(size_t frame, Page *) override {
+    positions[frame] = order.insert(order.end(), frame);
+  }
+  void onAccess(size_t frame) override {
+    order.splice(order.end(), order, positions[frame]);
+  }
+  size_t evict(const Page *) override {
+    size_t frame = order.front();
+    order.pop_front();
+    positions.erase(frame);
+    return frame;
+  }
+
+private:
+  std::list<size_t> order;
+  std::unordered_map<size_t, std::list<size_t>::iterator> positions;
+};
+
+// Evicts the page used least often since it was loaded, the one used least
+// recently among those.
+class LfuPolicy : public ReplacementPolicy {
+public:
+  explicit LfuPolicy(size_t frames) : uses(frames) {}
+
+  void onLoad(size_t frame, Page *) override {
+    uses[frame] = {1, ++clock};
+    order.insert({1, clock, frame});
+  }
+  void onAccess(size_t frame) override {
+    Use &use = uses[frame];
+    order.erase({use.count, use.last, frame});
+    use = {use.count + 1, ++clock};
+    order.insert({use.count, use.last, frame});
+  }
+  size_t evict(const Page *) override {
+    size_t frame = std::get<2>(*order.begin());
+    order.erase(order.begin());
+    return frame;
+  }
+
+private:
+  struct Use {
+    unsigned long long count;
+    unsigned long long last;
+  };
+  std::vector<Use> uses;
+  std::set<std::tuple<unsigned long long, unsigned long long, size_t>> order;
+  unsigned long long clock = 0;
+};
+
+// Adaptive replacement cache (Megiddo and Modha): T1 holds pages used once
+// since they were loaded, T2 pages used again, both in use order. B1 and B2
+// remember pages recently evicted from them. A fault on a page in B1 grows
+// the target size of T1, one in B2 shrinks it, and the victim comes from T1
+// while T1 is above its target.
+class ArcPolicy : public ReplacementPolicy {
+public:
+  explicit ArcPolicy(size_t frames) : capacity(frames), residents(frames) {}
+
+  void onLoad(size_t frame, Page *page) override {
+    auto ghost = ghosts.find(page);
+    bool frequent = ghost != ghosts.end();
+    if (frequent) {
+      (ghost->second.inB2 ? b2 : b1).erase(ghost->second.position);
+      ghosts.erase(ghost);
+    }
+    std::list<size_t> &list = frequent ? t2 : t1;
+    residents[frame] = {page, frequent, list.insert(list.end(), frame)};
+  }
+
+  void onAccess(size_t frame) override {
+    Resident &resident = residents[frame];
+    t2.splice(t2.end(), resident.frequent ? t2 : t1, resident.position);
+    resident.frequent = true;
+  }
+
+  size_t evict(const Page *incoming) override {
+    auto ghost = incoming ? ghosts.find(incoming) : ghosts.end();
+    bool inB2 = ghost != ghosts.end() && ghost->second.inB2;
+    if (ghost != ghosts.end() && !inB2) {
+      target = std::min<double>(
+          capacity, target + std::max(1.0, (double)b2.size() / b1.size()));
+    } else if (inB2) {
+      target =
+          std::max(0.0, target - std::max(1.0, (double)b1.size() / b2.size()));
+    } else if (t1.size() + b1.size() >= capacity) {
+      if (b1.empty()) {
+        // T1 fills the memory: its oldest page leaves without a trace.
+        size_t frame = t1.front();
+        t1.pop_front();
+        return frame;
+      }
+      forget(b1);
+    } else if (t1.size() + t2.size() + b1.size() + b2.size() >=
+                   2 * capacity &&
+               !b2.empty()) {
+      forget(b2);
+    }
+    bool fromT1 = !t1.empty() && (t2.empty() || t1.size() > target ||
+                                  (inB2 && t1.size() == target));
+    std::list<size_t> &list = fromT1 ? t1 : t2;
+    size_t frame = list.front();
+    list.pop_front();
+    std::list<const Page *> &ghostList = fromT1 ? b1 : b2;
+    const Page *page = residents[frame].page;
+    ghosts[page] = {!fromT1, ghostList.insert(ghostList.end(), page)};
+    return frame;
+  }
+
+private:
+  struct Resident {
+    Page *page;
+    bool frequent;
+    std::list<size_t>::iterator position;
+  };
+  struct Ghost {
+    bool inB2;
+    std::list<const Page *>::iterator position;
+  };
+
+  size_t capacity;
+  // Target size of T1.
+  double target = 0;
+  std::vector<Resident> residents;
+  std::list<size_t> t1, t2;
+  std::list<const Page *> b1, b2;
+  std::unordered_map<const Page *, Ghost> ghosts;
+
+  void forget(std::list<const Page *> &ghostList) {
+    ghosts.erase(ghostList.front());
+    ghostList.pop_front();
+  }
+};
+
+// Belady's optimal policy: evicts the page whose next access is furthest in
+// the future. It needs the whole access trace in advance, so it only runs
+// offline, as a lower bound for the others on a recorded trace. Every load
+// or access must be the next entry of the trace.
+class OptimalPolicy : public ReplacementPolicy {
+public:
+  // `trace` numbers the pages densely.
+  explicit OptimalPolicy(size_t frames, const std::vector<int> &trace)
+      : nextAccesses(trace.size()), frameNext(frames) {
+    std::unordered_map<int, size_t> next;
+    for (size_t i = trace.size(); i-- > 0;) {
+      auto found = next.find(trace[i]);
+      nextAccesses[i] = found == next.end() ? trace.size() : found->second;
+      next[trace[i]] = i;
+    }
+  }
+
+  void onLoad(size_t frame, Page *) override {
+    frameNext[frame] = nextAccesses[position++];
+    order.insert({frameNext[frame], frame});
+  }
+  void onAccess(size_t frame) override {
+    order.erase({frameNext[frame], frame});
+    onLoad(frame, nullptr);
+  }
+  size_t evict(const Page *) override {
+    auto furthest = std::prev(order.end());
+    size_t frame = furthest->second;
+    order.erase(furthest);
+    return frame;
+  }
+
+private:
+  // Index of the next access to the same page for every trace entry, the
+  // trace size if there is none.
+  std::vector<size_t> nextAccesses;
+  std::vector<size_t> frameNext;
+  std::set<std::pair<size_t, size_t>> order;
+  size_t position = 0;
+};
+
+// The policies the memory manager can run; opt is only replayed.
+const char *const REPLACEMENT_POLICIES[] = {"fifo", "clock", "lru",
+                                            "lfu",  "arc",   "opt"};
+
+std::unique_ptr<ReplacementPolicy>
+makeReplacementPolicy(const std::string &name, size_t frames) {
+  if (name == "clock")
+    return std::make_unique<ClockPolicy>(frames);
+  if (name == "lru")
+    return std::make_unique<LruPolicy>();
+  if (name == "lfu")
+    return std::make_unique<LfuPolicy>(frames);
+  if (name == "arc")
+    return std::make_unique<ArcPolicy>(frames);
+  if (name != "fifo")
+    std::cerr << "Replacement policy " << name
+              << " is not fifo, clock, lru, lfu or arc, using fifo."
+              << std::endl;
+  return std::make_unique<FifoPolicy>();
+}
+
+// Page faults of policy `name` on the pages accessed in `trace`, with
+// `frames` frames and a victim only when all of them are in use, as in the
+// memory manager. The pages are copies, so reference bits stay untouched.
+unsigned long long replayFaults(const std::string &name,
+                                const std::vector<const Page *> &trace,
+                                size_t frames) {
+  std::unordered_map<const Page *, int> ids;
+  std::vector<Page> pages;
+  std::vector<int> accesses;
+  accesses.reserve(trace.size());
+  for (const Page *page : trace) {
+    auto id = ids.emplace(page, (int)pages.size());
+    if (id.second) {
+      pages.emplace_back(page->getPid(), page->getVirtualAddress(), -1);
+    }
+    accesses.push_back(id.first->second);
+  }
+  std::unique_ptr<ReplacementPolicy> policy =
+      name == "opt" ? std::make_unique<OptimalPolicy>(frames, accesses)
+                    : makeReplacementPolicy(name, frames);
+
+  std::vector<int> frameOf(pages.size(), -1);
+  std::vector<int> owner(frames, -1);
+  size_t used = 0;
+  unsigned long long faults = 0;
+  for (int id : accesses) {
+    Page &page = pages[id];
+    if (frameOf[id] >= 0) {
+      page.setReferenced(true);
+      policy->onAccess(frameOf[id]);
+      continue;
+    }
+    faults++;
+    size_t frame = used < frames ? used++ : policy->evict(&page);
+    if (owner[frame] >= 0) {
+      frameOf[owner[frame]] = -1;
+      pages[owner[frame]].setReferenced(false);
+    }
+    owner[frame] = id;
+    frameOf[id] = frame;
+    policy->onLoad(frame, &page);
+    page.setReferenced(true);
+  }
+  return faults;
+}
+
+#endif // REPLACEMENT_H
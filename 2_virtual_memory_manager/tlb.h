@@ -0,0 +1,184 @@
+#ifndef TLB_H
+#define TLB_H
+#include "utils.h"
+
+// Simulated cycles of a TLB hit and of every page table level a walk reads.
+#define TLB_HIT_CYCLES 1
+#define PAGE_WALK_LEVEL_CYCLES 100
+// Address space identifiers the TLB can tag entries with. When they run out
+// the TLB is flushed and numbering starts over.
+#define TLB_ASIDS 256
+
+class Page;
+
+// Set-associative translation cache in front of the page table. A virtual
+// page number maps to set `vpn % sets` and may sit in any of its ways.
+// Without ASIDs the whole TLB is flushed on every context switch and entries
+// are tagged with the pid; with them entries are tagged with the address
+// space of their process and survive switches, so a process finds its
+// translations again when it comes back.
+class Tlb {
+public:
+  explicit Tlb(const SimulationOptions &options)
+      : entries(options.tlbEntries), replacement(options.tlbReplacement),
+        useAsids(options.tlbAsids), random(RANDOM_TLB, 0) {
+    ways = options.tlbWays == 0 ? entries
+                                : std::min(options.tlbWays, entries);
+    if (ways > 0 && entries % ways != 0) {
+      std::cerr << "TLB of " << entries << " entries has no " << ways
+                << " ways, using fully associative." << std::endl;
+      ways = entries;
+    }
+    sets = ways ? entries / ways : 0;
+    slots.resize(entries);
+  }
+
+  bool enabled() const { return entries > 0; }
+
+  // The cached entry for `virtualPage` of `pid`, nullptr on a miss.
+  Page *lookup(pid_t pid, int virtualPage) {
+    if (!enabled()) {
+      return nullptr;
+    }
+    lookups++;
+    Slot *set = &slots[(virtualPage % sets) * ways];
+    int asid = asidOf(pid);
+    for (unsigned way = 0; way < ways; way++) {
+      if (set[way].page && set[way].asid == asid &&
+          set[way].virtualPage == virtualPage) {
+        hits++;
+        if (replacement == TlbReplacement::LRU) {
+          set[way].stamp = ++clock;
+        }
+        return set[way].page;
+      }
+    }
+    return nullptr;
+  }
+
+  // Caches the translation a page table walk found.
+  void insert(pid_t pid, int virtualPage, Page *page) {
+    if (!enabled()) {
+      return;
+    }
+    Slot *set = &slots[(virtualPage % sets) * ways];
+    unsigned victim = 0;
+    while (victim < ways && set[victim].page) {
+      victim++;
+    }
+    if (victim == ways && replacement == TlbReplacement::RANDOM) {
+      victim = random.range(0, ways - 1);
+    } else if (victim == ways) {
+      victim = 0;
+      for (unsigned way = 1; way < ways; way++) {
+        if (set[way].stamp < set[victim].stamp) {
+          victim = way;
+        }
+      }
+    }
+    set[victim] = {page, asidOf(pid), virtualPage, ++clock};
+  }
+
+  // Drops the translation of a page that no longer is where it points to.
+  void invalidate(int virtualPage, Page *page) {
+    if (!enabled()) {
+      return;
+    }
+    Slot *set = &slots[(virtualPage % sets) * ways];
+    for (unsigned way = 0; way < ways; way++) {
+      if (set[way].page == page) {
+        set[way].page = nullptr;
+      }
+    }
+  }
+
+  void contextSwitch(pid_t pid) {
+    if (!enabled()) {
+      return;
+    }
+    if (!useAsids) {
+      flush();
+      return;
+    }
+    asidOf(pid);
+  }
+
+  void logStat() const {
+    if (!enabled()) {
+      std::cout << "TLB: off" << std::endl;
+      return;
+    }
+    unsigned long long misses = lookups - hits;
+    unsigned long long cycles =
+        hits * TLB_HIT_CYCLES + misses * (TLB_HIT_CYCLES + missPenalty());
+    std::cout << "TLB: " << entries << " entries, " << ways << " ways, "
+              << (useAsids ? "ASID tagged" : "flushed on switch") << std::endl;
+    printf("TLB Hit Rate: %.2f%%\n", lookups ? hits * 100.0 / lookups : 0.0);
+    printf("TLB Miss Penalty: %d cycles\n", missPenalty());
+    printf("Translation Cycles Avg: %.2f\n",
+           lookups ? (double)cycles / lookups : 0.0);
+    fflush(stdout);
+    std::cout << "Page Table Walks: " << misses << ", TLB Flushes: " << flushes
+              << std::endl;
+  }
+
+private:
+  struct Slot {
+    Page *page = nullptr;
+    // The pid when ASIDs are off.
+    int asid = 0;
+    int virtualPage = 0;
+    // Last use under LRU, insertion under FIFO.
+    unsigned long long stamp = 0;
+  };
+  struct Asid {
+    int asid = -1;
+    unsigned generation = 0;
+  };
+
+  unsigned entries;
+  unsigned ways;
+  unsigned sets;
+  TlbReplacement replacement;
+  bool useAsids;
+  RandomStream random;
+  std::vector<Slot> slots;
+  std::unordered_map<pid_t, Asid> asids;
+  int nextAsid = 0;
+  unsigned generation = 0;
+  unsigned long long clock = 0;
+  unsigned long long lookups = 0;
+  unsigned long long hits = 0;
+  unsigned long long flushes = 0;
+
+  // A walk reads one entry per page table level.
+  static int missPenalty() { return PAGE_TABLE_LEVELS * PAGE_WALK_LEVEL_CYCLES; }
+
+  // The address space of `pid`, numbered on its first use since the last
+  // rollover. Without ASIDs the pid itself, so a translation for another
+  // process never hits even before the next flush.
+  int asidOf(pid_t pid) {
+    if (!useAsids) {
+      return pid;
+    }
+    Asid &asid = asids[pid];
+    if (asid.generation != generation || asid.asid < 0) {
+      if (nextAsid == TLB_ASIDS) {
+        flush();
+        generation++;
+        nextAsid = 0;
+      }
+      asid = {nextAsid++, generation};
+    }
+    return asid.asid;
+  }
+
+  void flush() {
+    for (Slot &slot : slots) {
+      slot.page = nullptr;
+    }
+    flushes++;
+  }
+};
+
+#endif // TLB_H
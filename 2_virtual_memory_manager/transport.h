@@ -0,0 +1,445 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "utils.h"
+
+#define PROTOCOL_VERSION 1
+#define COMMAND_PAYLOAD_SIZE 32
+
+// Fixed binary layout of every command. Params of one type are packed back
+// to back in the payload; only the header and the used bytes are sent.
+struct CommandMessage {
+  uint8_t version;
+  uint8_t command;
+  uint8_t paramCount;
+  uint8_t paramSize;
+  int32_t sender;
+  unsigned char payload[COMMAND_PAYLOAD_SIZE];
+};
+
+struct message {
+  long mtype;
+  CommandMessage body;
+};
+
+size_t commandLength(size_t paramCount, size_t paramSize) {
+  return offsetof(CommandMessage, payload) + paramCount * paramSize;
+}
+
+template <typename T>
+bool validateCommand(const CommandMessage &command, size_t length) {
+  if (length < commandLength(0, 0)) {
+    std::cerr << "Truncated message of " << length << " bytes." << std::endl;
+    return false;
+  }
+  if (command.version != PROTOCOL_VERSION) {
+    std::cerr << "Unsupported protocol version " << (int)command.version
+              << "." << std::endl;
+    return false;
+  }
+  if (command.paramCount > 0 && command.paramSize != sizeof(T)) {
+    std::cerr << "Message params of " << (int)command.paramSize
+              << " bytes, expected " << sizeof(T) << "." << std::endl;
+    return false;
+  }
+  if (command.paramCount * sizeof(T) > COMMAND_PAYLOAD_SIZE ||
+      length != commandLength(command.paramCount, command.paramSize)) {
+    std::cerr << "Malformed message with " << (int)command.paramCount
+              << " params in " << length << " bytes." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <typename T> T commandParam(const CommandMessage &command, size_t i) {
+  T param;
+  std::memcpy(&param, command.payload + i * sizeof(T), sizeof(T));
+  return param;
+}
+
+// Carries kernel <-> user process messages. Receivers are addressed by pid
+// exactly like the mtype of a SysV message.
+class Transport {
+public:
+  virtual ~Transport() {}
+  virtual bool send(const message &msg, size_t length) = 0;
+  virtual bool receive(long receiver, message &msg, size_t &length,
+                       bool wait) = 0;
+  virtual bool isClosed() const { return false; }
+};
+
+class MessageQueueTransport : public Transport {
+public:
+  explicit MessageQueueTransport(int msgid) : msgid(msgid) {}
+
+  bool send(const message &msg, size_t length) override {
+    if (msgsnd(msgid, &msg, length, IPC_NOWAIT) == -1) {
+      std::cerr << msgid << " Error sending message. Error code: " << errno
+                << std::endl;
+      LOG(SCHED, ERROR) << msgid << " Error sending message. Error code: "
+                        << errno << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool receive(long receiver, message &msg, size_t &length,
+               bool wait) override {
+    ssize_t received = msgrcv(msgid, &msg, sizeof(msg.body), receiver,
+                              wait ? 0 : IPC_NOWAIT);
+    if (received < 0) {
+      if (errno == EIDRM || errno == EINVAL)
+        closed = true;
+      if (errno != ENOMSG && errno != EINTR)
+        std::cerr << "Error receiving message. Error code: " << errno
+                  << std::endl;
+      return false;
+    }
+    length = received;
+    return true;
+  }
+
+  bool isClosed() const override { return closed; }
+
+  void clear() {
+    LOG(SCHED, INFO) << "Clear Message Queue " << msgid << std::endl;
+    message msg;
+    while (msgrcv(msgid, &msg, sizeof(msg.body), 0, IPC_NOWAIT) != -1) {
+    }
+
+    if (errno != ENOMSG) {
+      std::cerr << "Error in clearing message queue: " << strerror(errno)
+                << std::endl;
+    }
+  }
+
+  void remove() { msgctl(msgid, IPC_RMID, NULL); }
+
+private:
+  int msgid;
+  bool closed = false;
+};
+
+// In-process transport. Messages to a receiver with a handler (a user process
+// state machine) are dispatched synchronously; everything else is queued in
+// the receiver's mailbox until it is received.
+class LocalTransport : public Transport {
+public:
+  void attach(long receiver,
+              std::function<void(const message &, size_t)> handler) {
+    handlers[receiver] = handler;
+  }
+
+  void detach(long receiver) { handlers.erase(receiver); }
+
+  bool send(const message &msg, size_t length) override {
+    auto handler = handlers.find(msg.mtype);
+    if (handler != handlers.end()) {
+      std::function<void(const message &, size_t)> deliver = handler->second;
+      deliver(msg, length);
+    } else {
+      mailboxes[msg.mtype].push({msg, length});
+    }
+    return true;
+  }
+
+  bool receive(long receiver, message &msg, size_t &length,
+               bool /*wait*/) override {
+    auto mailbox = mailboxes.find(receiver);
+    if (mailbox == mailboxes.end() || mailbox->second.empty()) {
+      return false; // nothing can arrive while the single thread waits
+    }
+    msg = mailbox->second.front().first;
+    length = mailbox->second.front().second;
+    mailbox->second.pop();
+    return true;
+  }
+
+private:
+  std::unordered_map<long, std::function<void(const message &, size_t)>>
+      handlers;
+  std::unordered_map<long, std::queue<std::pair<message, size_t>>> mailboxes;
+};
+
+// Shared-memory transport for forked children: one single-producer/
+// single-consumer ring per direction and child in a MAP_SHARED segment. An
+// empty receiver sleeps on a futex, which producers only wake when somebody
+// is sleeping.
+#define SHM_RING_CAPACITY 256
+#define SHM_MAX_PEERS 4096
+
+struct SharedRing {
+  alignas(64) std::atomic<uint64_t> head; // next entry to read
+  alignas(64) std::atomic<uint64_t> tail; // next entry to write
+  alignas(64) std::atomic<uint32_t> sequence; // futex word, bumped per write
+  std::atomic<uint32_t> sleepers;
+  struct Entry {
+    uint32_t length;
+    message msg;
+  } entries[SHM_RING_CAPACITY];
+};
+
+struct SharedSegmentHeader {
+  std::atomic<uint32_t> closed;
+  // The kernel sleeps on this word for messages from any child.
+  std::atomic<uint32_t> kernelSequence;
+  std::atomic<uint32_t> kernelSleepers;
+};
+
+void futexWait(std::atomic<uint32_t> *word, uint32_t expected) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected,
+          nullptr, nullptr, 0);
+#else
+  if (word->load() == expected)
+    std::this_thread::yield();
+#endif
+}
+
+void futexWakeAll(std::atomic<uint32_t> *word) {
+#ifdef __linux__
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE,
+          INT32_MAX, nullptr, nullptr, 0);
+#endif
+}
+
+class SharedMemoryTransport : public Transport {
+public:
+  // Maps the segment; must happen before the children are forked.
+  SharedMemoryTransport(pid_t kernelPid, size_t maxPeers)
+      : kernelPid(kernelPid),
+        maxPeers(std::min<size_t>(maxPeers, SHM_MAX_PEERS)) {
+    maskWords = (this->maxPeers + 63) / 64;
+    size = sizeof(SharedSegmentHeader) +
+           maskWords * sizeof(std::atomic<uint64_t>) +
+           2 * this->maxPeers * sizeof(SharedRing);
+    void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapped == MAP_FAILED) {
+      std::cerr << "Cannot map shared transport: " << strerror(errno)
+                << std::endl;
+      this->maxPeers = 0;
+      return;
+    }
+    // Anonymous memory is zeroed, which is a valid empty state for all rings.
+    segment = static_cast<char *>(mapped);
+    header = reinterpret_cast<SharedSegmentHeader *>(segment);
+    readyMask = reinterpret_cast<std::atomic<uint64_t> *>(
+        segment + sizeof(SharedSegmentHeader));
+    rings = reinterpret_cast<SharedRing *>(
+        segment + sizeof(SharedSegmentHeader) +
+        maskWords * sizeof(std::atomic<uint64_t>));
+  }
+
+  ~SharedMemoryTransport() {
+    if (segment)
+      munmap(segment, size);
+  }
+
+  // Slot for the next child, -1 once all are taken. Call before fork().
+  int reserveSlot() {
+    return nextSlot < maxPeers ? (int)nextSlot++ : -1;
+  }
+
+  // In the kernel after fork(): messages to `pid` go to its slot.
+  void bindPeer(int slot, pid_t pid) { slots[pid] = slot; }
+
+  // In the child after fork(): this process talks to the kernel via `slot`.
+  void becomePeer(int slot) { localSlot = slot; }
+
+  bool send(const message &msg, size_t length) override {
+    if (!segment)
+      return false;
+    if (localSlot >= 0) {
+      if (msg.mtype != kernelPid) {
+        std::cerr << "Children can only message the kernel." << std::endl;
+        return false;
+      }
+      if (!push(upRing(localSlot), msg, length))
+        return false;
+      readyMask[localSlot / 64].fetch_or(1ULL << (localSlot % 64));
+      header->kernelSequence.fetch_add(1);
+      if (header->kernelSleepers.load() > 0)
+        futexWakeAll(&header->kernelSequence);
+      return true;
+    }
+    auto slot = slots.find(msg.mtype);
+    if (slot == slots.end()) {
+      std::cerr << "No shared ring for " << msg.mtype << "." << std::endl;
+      return false;
+    }
+    SharedRing &ring = downRing(slot->second);
+    if (!push(ring, msg, length))
+      return false;
+    ring.sequence.fetch_add(1);
+    if (ring.sleepers.load() > 0)
+      futexWakeAll(&ring.sequence);
+    return true;
+  }
+
+  bool receive(long /*receiver*/, message &msg, size_t &length,
+               bool wait) override {
+    if (!segment)
+      return false;
+    if (localSlot >= 0) {
+      SharedRing &ring = downRing(localSlot);
+      return waitFor([&] { return pop(ring, msg, length); }, ring.sequence,
+                     ring.sleepers, wait);
+    }
+    return waitFor([&] { return popAnyChild(msg, length); },
+                   header->kernelSequence, header->kernelSleepers, wait);
+  }
+
+  bool isClosed() const override { return !segment || header->closed.load(); }
+
+  // Wakes every sleeping receiver and makes them see the transport closed.
+  void close() {
+    if (!segment)
+      return;
+    header->closed.store(1);
+    header->kernelSequence.fetch_add(1);
+    futexWakeAll(&header->kernelSequence);
+    for (size_t slot = 0; slot < nextSlot; slot++) {
+      downRing(slot).sequence.fetch_add(1);
+      futexWakeAll(&downRing(slot).sequence);
+    }
+  }
+
+private:
+  pid_t kernelPid;
+  size_t maxPeers;
+  size_t maskWords;
+  size_t size = 0;
+  char *segment = nullptr;
+  SharedSegmentHeader *header = nullptr;
+  std::atomic<uint64_t> *readyMask = nullptr;
+  SharedRing *rings = nullptr;
+  size_t nextSlot = 0;
+  size_t nextScanWord = 0;
+  int localSlot = -1;
+  std::unordered_map<long, int> slots;
+
+  SharedRing &downRing(int slot) { return rings[2 * slot]; }
+  SharedRing &upRing(int slot) { return rings[2 * slot + 1]; }
+
+  static bool push(SharedRing &ring, const message &msg, size_t length) {
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) ==
+        SHM_RING_CAPACITY) {
+      std::cerr << "Shared ring full, message to " << msg.mtype
+                << " dropped." << std::endl;
+      return false;
+    }
+    SharedRing::Entry &entry = ring.entries[tail % SHM_RING_CAPACITY];
+    entry.length = length;
+    memcpy(&entry.msg, &msg, offsetof(message, body) + length);
+    ring.tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  static bool pop(SharedRing &ring, message &msg, size_t &length) {
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head == ring.tail.load(std::memory_order_acquire))
+      return false;
+    const SharedRing::Entry &entry = ring.entries[head % SHM_RING_CAPACITY];
+    length = std::min<size_t>(entry.length, sizeof(msg.body));
+    memcpy(&msg, &entry.msg, offsetof(message, body) + length);
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Children flag their up ring in readyMask after writing; the scan resumes
+  // at the word it last read from so no child is starved.
+  bool popAnyChild(message &msg, size_t &length) {
+    for (size_t i = 0; i < maskWords; i++) {
+      size_t word = (nextScanWord + i) % maskWords;
+      uint64_t bits = readyMask[word].load();
+      while (bits) {
+        int slot = word * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        SharedRing &ring = upRing(slot);
+        if (pop(ring, msg, length)) {
+          nextScanWord = word;
+          return true;
+        }
+        // Clear the flag, then look again in case a write raced with it.
+        readyMask[word].fetch_and(~(1ULL << (slot % 64)));
+        if (ring.tail.load() != ring.head.load())
+          readyMask[word].fetch_or(1ULL << (slot % 64));
+      }
+    }
+    return false;
+  }
+
+  // The sleeper count and sequence are read around the emptiness check, so a
+  // producer either sees the sleeper or changes the value futexWait expects.
+  template <typename TryReceive>
+  bool waitFor(TryReceive tryReceive, std::atomic<uint32_t> &sequence,
+               std::atomic<uint32_t> &sleepers, bool wait) {
+    if (tryReceive())
+      return true;
+    if (!wait)
+      return false;
+    sleepers.fetch_add(1);
+    bool received = false;
+    while (!shutdownRequested && !header->closed.load()) {
+      uint32_t expected = sequence.load();
+      if ((received = tryReceive()))
+        break;
+      futexWait(&sequence, expected);
+    }
+    sleepers.fetch_sub(1);
+    return received || tryReceive();
+  }
+};
+
+template <typename T>
+void sendCommand(Transport &transport, pid_t sender, pid_t receiver,
+                 int command, const T *additionalParams, size_t paramCount) {
+  if (paramCount * sizeof(T) > COMMAND_PAYLOAD_SIZE) {
+    std::cerr << "Too many params for command " << command << ", truncated."
+              << std::endl;
+    paramCount = COMMAND_PAYLOAD_SIZE / sizeof(T);
+  }
+  message msg;
+  msg.mtype = receiver;
+  msg.body.version = PROTOCOL_VERSION;
+  msg.body.command = command;
+  msg.body.paramCount = paramCount;
+  msg.body.paramSize = sizeof(T);
+  msg.body.sender = sender;
+  if (paramCount > 0) {
+    std::memcpy(msg.body.payload, additionalParams, paramCount * sizeof(T));
+  }
+  transport.send(msg, commandLength(paramCount, sizeof(T)));
+}
+
+template <typename T>
+void sendCommand(Transport &transport, pid_t sender, pid_t receiver,
+                 int command, std::initializer_list<T> additionalParams = {}) {
+  sendCommand<T>(transport, sender, receiver, command,
+                 additionalParams.begin(), additionalParams.size());
+}
+
+template <typename T>
+bool decodeCommand(const message &receivedMessage, size_t length,
+                   CommandMessage &command) {
+  if (!validateCommand<T>(receivedMessage.body, length)) {
+    return false;
+  }
+  command = receivedMessage.body;
+  return true;
+}
+
+template <typename T>
+bool receiveCommand(Transport &transport, long myPID, CommandMessage &command,
+                    bool wait = false) {
+  message receivedMessage;
+  size_t length = 0;
+  if (!transport.receive(myPID, receivedMessage, length, wait)) {
+    return false;
+  }
+  return decodeCommand<T>(receivedMessage, length, command);
+}
+
+#endif // TRANSPORT_H
@@ -1,6 +1,8 @@
 #ifndef USER_H
 #define USER_H
+#include "transport.h"
 #include "utils.h"
+#include "workload.h"
 
 class PCB {
 public:
@@ -11,59 +13,108 @@ public:
 
 class UserProcess {
 public:
-  UserProcess(pid_t pid, int cpuBurst, int msgid_str, int msgid_int)
-      : status(ProcessStatus::READY), pcb(pid, cpuBurst), msgid_str(msgid_str),
-        msgid_int(msgid_int) {
-    std::cout << CHILD_LOG_PREFIX << "Child Process Created!" << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t PID : " << pcb.pid << std::endl;
-    std::cout << CHILD_LOG_PREFIX << "\t CPU Burst : " << pcb.cpuBurst
-              << std::endl;
+  // `streamId` picks the random streams, so a process draws the same
+  // emojis, addresses and reborn ticks whatever pid it gets.
+  UserProcess(pid_t pid, int cpuBurst, Transport &strTransport,
+              Transport &intTransport, pid_t kernelPid,
+              const SimulationOptions &options, uint64_t streamId = 0)
+      : status(ProcessStatus::READY), strTransport(strTransport),
+        intTransport(intTransport), kernelPid(kernelPid), pcb(pid, cpuBurst),
+        emojiRandom(RANDOM_EMOJIS, streamId),
+        rebornRandom(RANDOM_REBORN, streamId),
+        accessRandom(RANDOM_ACCESS, streamId),
+        accessLocality(options.accessLocality) {
+    workingSetPages = accessRandom.range(1, options.maxWorkingSetPages);
+    firstPage = accessRandom.range(0, VIRTUAL_PAGES - workingSetPages);
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child Process Created!"
+                     << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t PID : " << pcb.pid << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "\t CPU Burst : " << pcb.cpuBurst
+                     << std::endl;
   }
 
   void logInfo() {
-    std::cout << "pid(" << pcb.pid << ") : "
-              << "[" << this->status << "] " << pcb.cpuBurst << std::endl;
+    LOG(CHILD, DEBUG) << "pid(" << pcb.pid << ") : " << "[" << this->status
+                      << "] " << pcb.cpuBurst << std::endl;
   }
 
   void run() {
-    std::cout << CHILD_LOG_PREFIX << "Child Process " << pcb.pid
-              << " listen to message queue" << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child Process " << pcb.pid
+                     << " listen to message queue" << std::endl;
+    installShutdownHandler();
+    logFlush();
     thread = std::thread(&UserProcess::tickHandler, this);
+    // Route shutdown signals to the listening thread so they interrupt it.
+    sigset_t shutdownSignals;
+    sigemptyset(&shutdownSignals);
+    sigaddset(&shutdownSignals, SIGTERM);
+    sigaddset(&shutdownSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &shutdownSignals, nullptr);
     thread.join();
   }
 
+  // In-process backend: the transport hands every message for this process
+  // straight to the state machine, no thread and no polling involved.
+  void onMessage(const message &msg, size_t length) {
+    CommandMessage command;
+    if (decodeCommand<int>(msg, length, command)) {
+      handleCommand(command.command);
+    }
+  }
+
+  bool isShutDown() const { return status == ProcessStatus::SHUT_DOWN; }
+
+  // Lives come from the entry's CPU bursts and reborn delays from its IO
+  // bursts; the process stays terminated after its last CPU burst. The PCB
+  // must hold the first CPU burst.
+  void followWorkload(const WorkloadEntry &entry) {
+    scriptedBursts = entry.bursts;
+    nextScriptedBurst = 1;
+    scripted = true;
+  }
+
 private:
   int status;
-  int msgid_str;
-  int msgid_int;
+  Transport &strTransport;
+  Transport &intTransport;
+  pid_t kernelPid;
   PCB pcb;
+  RandomStream emojiRandom;
+  RandomStream rebornRandom;
+  // The process writes to `workingSetPages` consecutive pages from
+  // `firstPage` on, one emoji slot at a time.
+  RandomStream accessRandom;
+  unsigned accessLocality;
+  unsigned workingSetPages;
+  unsigned firstPage;
+  unsigned accessPage = 0;
+  unsigned accessSlot = 0;
+  bool scripted = false;
+  std::vector<int> scriptedBursts;
+  size_t nextScriptedBurst = 0;
+
+  void handleCommand(int command) {
+    if (command != -1) {
+      LOG(CHILD, DEBUG) << CHILD_LOG_PREFIX << "Child " << pcb.pid
+                        << " received command " << command << std::endl;
+      commandHandler(command);
+    }
+  }
 
+  // Blocks until the next command arrives, so an idle child costs no CPU and
+  // reacts as soon as the kernel sends something.
   void tickHandler() {
-    while (status != ProcessStatus::SHUT_DOWN) {
-      auto [command, additionalParams] =
-          receiveCommand<int>(msgid_int, pcb.pid);
-      if (command != -1) {
-        std::cout << CHILD_LOG_PREFIX << "Child " << pcb.pid
-                  << " received command " << command << std::endl;
-        commandHandler(command);
-      }
-      std::this_thread::sleep_for(std::chrono::milliseconds(TIME_TICK * 250));
-      if (status == ProcessStatus::TERMINATED) {
-        if (rebornTime > 0) {
-          rebornTime--;
-        } else {
-          status = ProcessStatus::READY;
-          pcb = PCB(pcb.pid, randomRange(MIN_CPU_BURST, MAX_CPU_BURST));
-          std::cout << CHILD_LOG_PREFIX << "Child " << pcb.pid
-                    << " send reborn signal with CPU Burst " << pcb.cpuBurst
-                    << std::endl;
-          sendCommand<int>(msgid_int, getppid(), UserCommand::REBORN,
-                           {pcb.pid, pcb.cpuBurst});
-        }
+    while (status != ProcessStatus::SHUT_DOWN && !shutdownRequested &&
+           !intTransport.isClosed()) {
+      CommandMessage command;
+      // The kernel waits a while before the next command.
+      logFlush();
+      if (receiveCommand<int>(intTransport, pcb.pid, command, true)) {
+        handleCommand(command.command);
       }
     }
-    std::cout << CHILD_LOG_PREFIX << "Child " << pcb.pid << " Terminated"
-              << std::endl;
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child " << pcb.pid << " Terminated"
+                     << std::endl;
   }
 
   void commandHandler(int command) {
@@ -86,7 +137,7 @@ private:
   }
 
   void onSelectCPU() {
-    std::cout << CHILD_LOG_PREFIX << "Child[onSelectCPU] ";
+    LOG(CHILD, DEBUG) << CHILD_LOG_PREFIX << "Child[onSelectCPU] ";
     logInfo();
     status = ProcessStatus::RUNNING;
   }
@@ -100,26 +151,66 @@ private:
     }
     pcb.cpuBurst -= 1;
     if (pcb.cpuBurst >= 1) {
-      std::vector<char> randomEmoji = randomString();
-      sendCommand<char>(msgid_str, getppid(), UserCommand::MEMORY_REQUEST,
-                        randomEmoji);
-      std::cout << CHILD_LOG_PREFIX << "Child(" << pcb.pid << ") writes ";
-      for (char c : randomEmoji) {
-        std::cout << c;
+      std::vector<char> randomEmoji = randomString(emojiRandom);
+      int32_t virtualAddress = nextVirtualAddress();
+      std::vector<char> request(sizeof(virtualAddress));
+      std::memcpy(request.data(), &virtualAddress, sizeof(virtualAddress));
+      request.insert(request.end(), randomEmoji.begin(), randomEmoji.end());
+      sendCommand<char>(strTransport, pcb.pid, kernelPid,
+                        UserCommand::MEMORY_REQUEST, request.data(),
+                        request.size());
+      LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child(" << pcb.pid << ") writes "
+                       << std::string(randomEmoji.begin(), randomEmoji.end())
+                       << " at VA " << virtualAddress << std::endl;
+    }
+  }
+
+  // Mostly the slot after the last one, moving on to the next page of the
+  // working set; otherwise a random slot of a random page.
+  int32_t nextVirtualAddress() {
+    const unsigned slots = PAGE_SIZE / EMOJI_SIZE;
+    if (accessRandom.range(0, 99) < accessLocality) {
+      if (++accessSlot == slots) {
+        accessSlot = 0;
+        accessPage = (accessPage + 1) % workingSetPages;
       }
-      std::cout << std::endl;
+    } else {
+      accessPage = accessRandom.range(0, workingSetPages - 1);
+      accessSlot = accessRandom.range(0, slots - 1);
     }
+    return (firstPage + accessPage) * PAGE_SIZE + accessSlot * EMOJI_SIZE;
   }
 
+  // The reborn delay is counted by the kernel in its own ticks, so the
+  // signal goes out right away instead of after a local countdown.
   void onDeselect() {
     status = ProcessStatus::TERMINATED;
-    rebornTime = randomRange(MIN_REBORN_TICK, MAX_REBORN_TICK);
-    std::cout << CHILD_LOG_PREFIX << "Child[onDeselect] " << pcb.pid
-              << " will reborn after " << rebornTime << " ticks" << std::endl;
+    int rebornTime, cpuBurst;
+    if (scripted) {
+      if (nextScriptedBurst + 1 >= scriptedBursts.size()) {
+        LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child[onDeselect] " << pcb.pid
+                         << " finished its workload" << std::endl;
+        return;
+      }
+      rebornTime = scriptedBursts[nextScriptedBurst];
+      cpuBurst = scriptedBursts[nextScriptedBurst + 1];
+      nextScriptedBurst += 2;
+    } else {
+      rebornTime = rebornRandom.range(MIN_REBORN_TICK, MAX_REBORN_TICK);
+      cpuBurst = rebornRandom.range(MIN_CPU_BURST, MAX_CPU_BURST);
+    }
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child[onDeselect] " << pcb.pid
+                     << " will reborn after " << rebornTime << " ticks"
+                     << std::endl;
+    pcb = PCB(pcb.pid, cpuBurst);
+    LOG(CHILD, INFO) << CHILD_LOG_PREFIX << "Child " << pcb.pid
+                     << " send reborn signal with CPU Burst " << pcb.cpuBurst
+                     << std::endl;
+    sendCommand<int>(intTransport, pcb.pid, kernelPid, UserCommand::REBORN,
+                     {pcb.pid, pcb.cpuBurst, rebornTime});
   }
 
   std::thread thread;
-  int rebornTime = 0;
 };
 
 #endif // USER_H
@@ -2,22 +2,36 @@
 #define UTIL_H
 
 #include "emojis.h"
+#include "log.h"
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <optional>
 #include <queue>
 #include <random>
+#include <signal.h>
 #include <sstream>
 #include <string>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/msg.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <thread>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 #include <unordered_map>
 #include <vector>
 
@@ -29,7 +43,24 @@
 #define MIN_REBORN_TICK 2
 #define MAX_REBORN_TICK 20
 #define MEMORY_SIZE 5
-#define DISK_SIZE 256
+#define DISK_SIZE 1024
+// A page holds PAGE_SIZE bytes, four emoji slots. Virtual page numbers index
+// a radix page table of PAGE_TABLE_LEVELS levels of PAGE_TABLE_FANOUT entries.
+#define PAGE_OFFSET_BITS 4
+#define PAGE_SIZE (1 << PAGE_OFFSET_BITS)
+#define EMOJI_SIZE 4
+#define PAGE_TABLE_LEVEL_BITS 8
+#define PAGE_TABLE_LEVELS 2
+#define PAGE_TABLE_FANOUT (1 << PAGE_TABLE_LEVEL_BITS)
+#define VIRTUAL_PAGES (1 << (PAGE_TABLE_LEVEL_BITS * PAGE_TABLE_LEVELS))
+// Pages a process touches at most and the percentage of accesses that go to
+// the next slot instead of a random one of its pages.
+#define MAX_WORKING_SET_PAGES 8
+#define ACCESS_LOCALITY 80
+#define TLB_ENTRIES 16
+#define TLB_WAYS 4
+#define NUM_CHILD_PROCESSES 10
+#define IN_PROCESS_KERNEL_PID 1
 
 enum KernelCommand {
   EXECUTE_CPU = 0,
@@ -51,117 +82,224 @@ enum ProcessStatus {
   SHUT_DOWN = 4,
 };
 
-struct PartialUserProcess {
-  int pid;
-  int remainingCpuBurst;
+enum class TlbReplacement { LRU, FIFO, RANDOM };
+
+// The in-process backend runs every user process as a state machine inside
+// the kernel process instead of forking one OS process per child.
+// A workload file replaces the random lives and reborn delays.
+struct SimulationOptions {
+  bool inProcess = false;
+  // Kernel <-> child transport when forking: "msgqueue" or "shm".
+  std::string transport = "msgqueue";
+  int numProcesses = NUM_CHILD_PROCESSES;
+  std::string workloadPath;
+  // Messages the kernel handles per tick, 0 for all that are pending.
+  unsigned messageBudget = 0;
+  std::optional<unsigned> seed;
+  // Highest level logged per subsystem, see log.h.
+  LogLevels logLevels = logThresholds;
+  // Frames of physical memory.
+  unsigned memoryFrames = MEMORY_SIZE;
+  unsigned maxWorkingSetPages = MAX_WORKING_SET_PAGES;
+  unsigned accessLocality = ACCESS_LOCALITY;
+  // TLB entries (0 for none) and ways per set (0 for fully associative).
+  unsigned tlbEntries = TLB_ENTRIES;
+  unsigned tlbWays = TLB_WAYS;
+  TlbReplacement tlbReplacement = TlbReplacement::LRU;
+  // Tag entries with address spaces instead of flushing on every switch.
+  bool tlbAsids = false;
+  // Page replacement policy, see replacement.h.
+  std::string replacement = "fifo";
 };
 
-unsigned int randomRange(unsigned int min, unsigned int max) {
-  if (min > max) {
-    std::cerr << "min > max, return 0;" << std::endl
-              << "Make sure min <= max when you call this function after."
-              << std::endl;
-    return 0;
+SimulationOptions parseSimulationOptions(int argc, char *argv[]) {
+  SimulationOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--in-process") {
+      options.inProcess = true;
+    } else if (arg == "--transport" && i + 1 < argc) {
+      options.transport = argv[++i];
+      if (options.transport != "msgqueue" && options.transport != "shm") {
+        std::cerr << "Unknown transport " << options.transport
+                  << ", using msgqueue." << std::endl;
+        options.transport = "msgqueue";
+      }
+    } else if (arg == "--processes" && i + 1 < argc) {
+      options.numProcesses = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--message-budget" && i + 1 < argc) {
+      options.messageBudget = std::max(0, atoi(argv[++i]));
+    } else if (arg == "--seed" && i + 1 < argc) {
+      options.seed = strtoul(argv[++i], nullptr, 0);
+    } else if (arg == "--workload" && i + 1 < argc) {
+      options.workloadPath = argv[++i];
+    } else if (arg == "--frames" && i + 1 < argc) {
+      options.memoryFrames = std::clamp(atoi(argv[++i]), 1, DISK_SIZE);
+    } else if (arg == "--pages" && i + 1 < argc) {
+      options.maxWorkingSetPages =
+          std::clamp(atoi(argv[++i]), 1, VIRTUAL_PAGES);
+    } else if (arg == "--locality" && i + 1 < argc) {
+      options.accessLocality = std::clamp(atoi(argv[++i]), 0, 100);
+    } else if (arg == "--tlb" && i + 1 < argc) {
+      std::string value = argv[++i];
+      size_t colon = value.find(':');
+      options.tlbEntries = std::max(0, atoi(value.c_str()));
+      options.tlbWays = colon == std::string::npos
+                            ? options.tlbEntries
+                            : std::max(0, atoi(value.c_str() + colon + 1));
+    } else if (arg == "--tlb-replacement" && i + 1 < argc) {
+      std::string value = argv[++i];
+      if (value == "lru") {
+        options.tlbReplacement = TlbReplacement::LRU;
+      } else if (value == "fifo") {
+        options.tlbReplacement = TlbReplacement::FIFO;
+      } else if (value == "random") {
+        options.tlbReplacement = TlbReplacement::RANDOM;
+      } else {
+        std::cerr << "TLB replacement " << value
+                  << " is not lru, fifo or random, ignored." << std::endl;
+      }
+    } else if (arg == "--tlb-asid") {
+      options.tlbAsids = true;
+    } else if (arg == "--replacement" && i + 1 < argc) {
+      std::string value = argv[++i];
+      if (value != "fifo" && value != "clock" && value != "lru" &&
+          value != "lfu" && value != "arc") {
+        std::cerr << "Replacement policy " << value
+                  << " is not fifo, clock, lru, lfu or arc, ignored."
+                  << std::endl;
+        continue;
+      }
+      options.replacement = value;
+    } else if (arg == "--log-level" && i + 1 < argc) {
+      LogLevel level = LogLevel::OFF;
+      if (!parseLogLevel(argv[++i], level)) {
+        std::cerr << "Log level " << argv[i]
+                  << " is not off, error, warn, info or debug, ignored."
+                  << std::endl;
+        continue;
+      }
+      options.logLevels.fill(level);
+    } else if (arg == "--log" && i + 1 < argc) {
+      std::string value = argv[++i];
+      size_t colon = value.find(':');
+      LogSubsystem subsystem;
+      LogLevel level = LogLevel::OFF;
+      if (colon == std::string::npos ||
+          !parseLogSubsystem(value.substr(0, colon), subsystem) ||
+          !parseLogLevel(value.substr(colon + 1), level)) {
+        std::cerr << "Log filter " << value
+                  << " is not <sched|mm|child>:<level>, ignored." << std::endl;
+        continue;
+      }
+      options.logLevels[(int)subsystem] = level;
+    } else {
+      std::cerr << "Unknown option " << arg << ", ignored." << std::endl;
+    }
   }
+  return options;
+}
 
-  static std::random_device rd;
-  static std::mt19937 rng(rd());
-  std::uniform_int_distribution<unsigned int> uni(min, max);
+// Set when a child is asked to stop while it blocks on its next command.
+volatile sig_atomic_t shutdownRequested = 0;
 
-  return uni(rng);
-}
+void onShutdownSignal(int) { shutdownRequested = 1; }
 
-std::vector<char> stringToCharVector(const std::string &str) {
-  std::vector<char> charVector;
-  for (char c : str) {
-    charVector.push_back(c);
-  }
-  return charVector;
+// No SA_RESTART: a receive blocked in msgrcv returns with EINTR instead.
+void installShutdownHandler() {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onShutdownSignal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGTERM, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
 }
 
-std::vector<char> randomString() {
-  std::string randomEmoji = basicEmojis_4[randomRange(0, 51)];
-  return stringToCharVector(randomEmoji);
-}
+struct PartialUserProcess {
+  int pid;
+  int remainingCpuBurst;
+};
 
-struct message {
-  long mtype;
-  char mtext[40];
+// Subsystems drawing random numbers. Each process has its own stream per
+// subsystem, keyed by its arrival index rather than its pid.
+enum RandomSubsystem {
+  RANDOM_BURSTS = 1,
+  RANDOM_EMOJIS = 2,
+  RANDOM_REBORN = 3,
+  RANDOM_ACCESS = 4,
+  RANDOM_TLB = 5
 };
 
-template <typename T>
-void sendCommand(int msgid, pid_t receiver, int command,
-                 const std::vector<T> &additionalParams = {}) {
-  message msg;
-  memset(msg.mtext, 0, sizeof(msg.mtext));
-  msg.mtype = receiver;
-  std::ostringstream oss;
-  oss << command;
-  for (const T &param : additionalParams) {
-    oss << " " << param;
-  }
-  strncpy(msg.mtext, oss.str().c_str(), sizeof(msg.mtext) - 1);
-  msg.mtext[sizeof(msg.mtext) - 1] = '\0';
-
-  size_t messageLength = strlen(msg.mtext);
-  if (msgsnd(msgid, &msg, messageLength, IPC_NOWAIT) == -1) {
-    std::cerr << msgid << " Error sending message. Error code: " << errno
-              << std::endl;
-    std::cout << msgid << " Error sending message. Error code: " << errno
-              << std::endl;
-  }
+// Master seed of every stream, from std::random_device unless --seed is given.
+uint64_t &masterSeed() {
+  static uint64_t seed = std::random_device{}();
+  return seed;
 }
 
-template <typename T>
-std::pair<int, std::vector<T>> receiveCommand(int msgid, long myPID) {
-  message receivedMessage;
-  if (msgrcv(msgid, &receivedMessage, sizeof(receivedMessage.mtext), myPID,
-             IPC_NOWAIT) < 0) {
-    if (errno != ENOMSG)
-      std::cerr << "Error receiving message. Error code: " << errno
-                << std::endl;
-    return std::make_pair(-1, std::vector<T>{});
-  }
+void seedRandom(uint64_t seed) { masterSeed() = seed; }
 
-  std::istringstream iss(receivedMessage.mtext);
-  int command;
-  if (!(iss >> command)) {
-    std::cerr << "Error parsing message." << std::endl;
-    return std::make_pair(-1, std::vector<T>{});
-  }
+uint64_t splitMix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
 
-  std::vector<T> additionalParams;
-  T param;
-  while (iss >> param) {
-    additionalParams.push_back(param);
-  }
+// Counter-based generator: the n-th number of a stream is a hash of the
+// master seed, the stream key and n, so streams share no state and a forked
+// child draws exactly what its in-process twin would.
+class RandomStream {
+public:
+  RandomStream(RandomSubsystem subsystem, uint64_t id)
+      : key(splitMix64(((uint64_t)subsystem << 56) ^ id)) {}
 
-  return std::make_pair(command, additionalParams);
-}
+  uint64_t next() { return splitMix64(masterSeed() ^ splitMix64(key + counter++)); }
 
-void clearMessageQueue(int msgid) {
-  std::cout << "Clear Message Queue " << msgid << std::endl;
-  message msg;
-  while (msgrcv(msgid, &msg, sizeof(msg.mtext), 0, IPC_NOWAIT) != -1) {
+  unsigned int range(unsigned int min, unsigned int max) {
+    if (min > max) {
+      std::cerr << "min > max, return 0;" << std::endl
+                << "Make sure min <= max when you call this function after."
+                << std::endl;
+      return 0;
+    }
+    uint64_t span = (uint64_t)max - min + 1;
+    return min + (unsigned int)(((unsigned __int128)next() * span) >> 64);
   }
 
-  if (errno != ENOMSG) {
-    std::cerr << "Error in clearing message queue: " << strerror(errno)
-              << std::endl;
+private:
+  uint64_t key;
+  uint64_t counter = 0;
+};
+
+std::vector<char> stringToCharVector(const std::string &str) {
+  std::vector<char> charVector;
+  for (char c : str) {
+    charVector.push_back(c);
   }
+  return charVector;
+}
+
+std::vector<char> randomString(RandomStream &random) {
+  size_t count = sizeof(basicEmojis_4) / sizeof(basicEmojis_4[0]);
+  std::string randomEmoji = basicEmojis_4[random.range(0, count - 1)];
+  return stringToCharVector(randomEmoji);
 }
 
-void printTableHeader() {
-  printf("\n%-10s | %-10s\n", "PID", "CPU Burst");
-  printf("----------------------------------------\n");
+void printTableHeader(std::ostream &out) {
+  char line[64];
+  snprintf(line, sizeof(line), "\n%-10s | %-10s\n", "PID", "CPU Burst");
+  out << line << "----------------------------------------\n";
 }
 
-void printProcess(PartialUserProcess *process) {
-  printf("%-10d | %-10d\n", process->pid, process->remainingCpuBurst);
+void printProcess(PartialUserProcess *process, std::ostream &out) {
+  char line[64];
+  snprintf(line, sizeof(line), "%-10d | %-10d\n", process->pid,
+           process->remainingCpuBurst);
+  out << line;
 }
 
-void printTableFooter() {
-  printf("----------------------------------------\n");
+void printTableFooter(std::ostream &out) {
+  out << "----------------------------------------\n";
 }
 
 #endif // UTIL_H
@@ -0,0 +1,161 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+
+// A workload file lists one process per line, sorted by arrival tick:
+//
+//   # arrival [p<priority>] cpu [io cpu]...
+//   0 p120 10 5 8 3 4
+//   12 6
+//
+// Bursts alternate between CPU and IO and start and end with a CPU burst.
+// Blank lines and lines starting with '#' are skipped.
+struct WorkloadEntry {
+  unsigned arrival = 0;
+  int priority = 0;
+  std::vector<int> bursts;
+
+  int totalCpuBurst() const {
+    int total = 0;
+    for (size_t i = 0; i < bursts.size(); i += 2) total += bursts[i];
+    return total;
+  }
+};
+
+// Maps the file read-only and parses one line per next(), so only the pages
+// around the cursor need to be resident however long the workload is.
+class WorkloadReader {
+public:
+  ~WorkloadReader() { close(); }
+
+  bool open(const std::string &path) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      std::cerr << "Cannot open workload " << path << ": "
+                << strerror(errno) << std::endl;
+      close();
+      return false;
+    }
+    size = info.st_size;
+    if (size > 0) {
+      void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapped == MAP_FAILED) {
+        std::cerr << "Cannot map workload " << path << ": "
+                  << strerror(errno) << std::endl;
+        close();
+        return false;
+      }
+      madvise(mapped, size, MADV_SEQUENTIAL);
+      data = static_cast<const char *>(mapped);
+    }
+    cursor = data;
+    end = data + size;
+    return true;
+  }
+
+  void close() {
+    if (data) munmap(const_cast<char *>(data), size);
+    if (fd >= 0) ::close(fd);
+    data = cursor = end = nullptr;
+    fd = -1;
+  }
+
+  // Arrival tick of the next entry, nothing once the file is exhausted.
+  std::optional<unsigned> nextArrival() {
+    if (!pending && !parseNext()) return std::nullopt;
+    return pending->arrival;
+  }
+
+  bool next(WorkloadEntry &entry) {
+    if (!pending && !parseNext()) return false;
+    entry = std::move(*pending);
+    pending.reset();
+    return true;
+  }
+
+private:
+  int fd = -1;
+  size_t size = 0;
+  const char *data = nullptr;
+  const char *cursor = nullptr;
+  const char *end = nullptr;
+  unsigned line = 0;
+  unsigned lastArrival = 0;
+  std::optional<WorkloadEntry> pending;
+
+  void skipBlanks() {
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r')) cursor++;
+  }
+
+  void skipLine() {
+    while (cursor < end && *cursor != '\n') cursor++;
+    if (cursor < end) cursor++;
+  }
+
+  // The mapping is not null terminated, so numbers are parsed by hand.
+  bool parseNumber(long long &value) {
+    skipBlanks();
+    const char *start = cursor;
+    value = 0;
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+      value = value * 10 + (*cursor++ - '0');
+    }
+    return cursor != start;
+  }
+
+  bool atLineEnd() {
+    skipBlanks();
+    return cursor >= end || *cursor == '\n' || *cursor == '#';
+  }
+
+  bool parseNext() {
+    while (cursor < end) {
+      line++;
+      if (atLineEnd()) {
+        skipLine();
+        continue;
+      }
+      WorkloadEntry entry;
+      long long value;
+      bool valid = parseNumber(value);
+      entry.arrival = value;
+      if (valid && (skipBlanks(), cursor < end && *cursor == 'p')) {
+        cursor++;
+        valid = parseNumber(value);
+        entry.priority = value;
+      }
+      while (valid && !atLineEnd()) {
+        valid = parseNumber(value) && value > 0;
+        entry.bursts.push_back(value);
+      }
+      skipLine();
+      if (!valid || entry.bursts.empty()) {
+        std::cerr << "Workload line " << line
+                  << " is not '<arrival> [p<priority>] <cpu> [<io> <cpu>]...', ignored." << std::endl;
+        continue;
+      }
+      if (entry.bursts.size() % 2 == 0) {
+        std::cerr << "Workload line " << line
+                  << " ends with an IO burst, dropped." << std::endl;
+        entry.bursts.pop_back();
+      }
+      if (entry.arrival < lastArrival) {
+        std::cerr << "Workload line " << line
+                  << " arrives before the previous line, delayed to " << lastArrival << "." << std::endl;
+        entry.arrival = lastArrival;
+      }
+      lastArrival = entry.arrival;
+      pending = std::move(entry);
+      return true;
+    }
+    return false;
+  }
+};
+
+#endif // WORKLOAD_H